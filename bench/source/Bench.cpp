@@ -0,0 +1,580 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "Boolean.h"
+#include "Gds.h"
+#include "GdsRecords.h"
+#include "Kernels.h"
+#include "Writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Benchmarks of the library on generated GDS files. Run as
+// "bench <name> [arguments]"; without a name the benchmarks are listed.
+
+using namespace GDS;
+
+static double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned long ArgNumber(int argc, wchar_t* argv[], int index, unsigned long fallback)
+{
+	return index < argc ? wcstoul(argv[index], nullptr, 10) : fallback;
+}
+
+static const wchar_t* ArgString(int argc, wchar_t* argv[], int index, const wchar_t* fallback)
+{
+	return index < argc ? argv[index] : fallback;
+}
+
+static long long FileSize(const wchar_t* file)
+{
+	FILE* p_file = nullptr;
+	_wfopen_s(&p_file, file, L"rb");
+
+	if (!p_file)
+		throw std::runtime_error("Could not open the generated file");
+
+	fseek(p_file, 0, SEEK_END);
+	long long size = ftell(p_file);
+	fclose(p_file);
+
+	return size;
+}
+
+// Generated libraries
+
+static void BeginLibrary(Writer& out)
+{
+	// 1e-3 user units and 1e-9 meters per database unit
+	static const uint8_t units[16] = {
+		0x3E, 0x41, 0x89, 0x37, 0x4B, 0xC6, 0xA7, 0xEF,
+		0x39, 0x44, 0xB8, 0x2F, 0xA0, 0x9B, 0x5A, 0x51 };
+
+	out.BeginLibrary(units);
+}
+
+static void AppendRect(Writer& out, int32_t x, int32_t y, int32_t w, int32_t h, uint16_t layer)
+{
+	Pair p[5] = { { x, y }, { x + w, y }, { x + w, y + h }, { x, y + h }, { x, y } };
+
+	out.AppendPoly(p, 5, layer);
+}
+
+static void WriteFlatLibrary(const wchar_t* file, size_t bytes)
+{
+	// Structures of 200 rectangles each until the file has about 'bytes'
+
+	Writer out(file);
+	char name[32];
+
+	BeginLibrary(out);
+
+	for (unsigned s = 0; out.m_written < bytes; s++) {
+		snprintf(name, sizeof(name), "CELL%u", s);
+		out.BeginStructure(name);
+
+		for (int32_t i = 0; i < 200; i++)
+			AppendRect(out, (i % 20) * 1000, (i / 20) * 1000, 500 + i, 700, uint16_t(i % 8));
+
+		out.EndStructure();
+	}
+
+	out.EndLibrary();
+	out.Close();
+}
+
+static void AppendSref(Writer& out, const char* name, int32_t x, int32_t y)
+{
+	uint8_t xy[8];
+
+	for (int k = 0; k < 4; k++) {
+		xy[k] = uint8_t(uint32_t(x) >> (24 - 8 * k));
+		xy[4 + k] = uint8_t(uint32_t(y) >> (24 - 8 * k));
+	}
+
+	out.AppendRecord(GDS_SREF);
+	out.AppendString(GDS_SNAME, name);
+	out.AppendBytes(GDS_XY, xy, 8);
+	out.AppendRecord(GDS_ENDEL);
+}
+
+static void WriteTreeLibrary(const wchar_t* file, unsigned cells)
+{
+	// One rectangle per cell; the first 1% of the cells are top cells and
+	// every other cell i is referenced by the cells (i - tops) / 4 and
+	// (i - tops) / 3
+
+	unsigned tops = std::max(1U, cells / 100);
+	std::vector<std::vector<unsigned>> children(cells);
+	char name[32];
+
+	for (unsigned i = tops; i < cells; i++) {
+		children[(i - tops) / 4].push_back(i);
+		if ((i - tops) / 3 != (i - tops) / 4)
+			children[(i - tops) / 3].push_back(i);
+	}
+
+	Writer out(file);
+
+	BeginLibrary(out);
+
+	for (unsigned i = 0; i < cells; i++) {
+		snprintf(name, sizeof(name), "CELL%u", i);
+		out.BeginStructure(name);
+		AppendRect(out, 0, 0, 1000, 1000, uint16_t(i % 8));
+
+		for (size_t k = 0; k < children[i].size(); k++) {
+			snprintf(name, sizeof(name), "CELL%u", children[i][k]);
+			AppendSref(out, name, int32_t(k) * 2000, 2000);
+		}
+
+		out.EndStructure();
+	}
+
+	out.EndLibrary();
+	out.Close();
+}
+
+static void WriteArrayLibrary(const wchar_t* file, unsigned instances)
+{
+	// TOP places 'instances' copies of a block of 10 x 10 cells of 100
+	// rectangles, so it flattens to 10000 * instances polygons
+
+	Writer out(file);
+
+	BeginLibrary(out);
+
+	out.BeginStructure("LEAF");
+	for (int32_t i = 0; i < 100; i++)
+		AppendRect(out, (i % 10) * 100, (i / 10) * 100, 50 + i % 7, 60, uint16_t(i % 4));
+	out.EndStructure();
+
+	out.BeginStructure("BLOCK");
+	for (int32_t i = 0; i < 100; i++)
+		AppendSref(out, "LEAF", (i % 10) * 1000, (i / 10) * 1000);
+	out.EndStructure();
+
+	out.BeginStructure("TOP");
+	for (unsigned i = 0; i < instances; i++)
+		AppendSref(out, "BLOCK", int32_t(i % 100) * 10000, int32_t(i / 100) * 10000);
+	out.EndStructure();
+
+	out.EndLibrary();
+	out.Close();
+}
+
+// The benchmarks
+
+static void BenchLoad(int argc, wchar_t* argv[])
+{
+	// Load a file mapped and with fread: bench load [megabytes [file]]
+
+	size_t megabytes = ArgNumber(argc, argv, 2, 256);
+	const wchar_t* file = ArgString(argc, argv, 3, L"bench_load.gds");
+
+	WriteFlatLibrary(file, megabytes << 20);
+
+	double size = double(FileSize(file)) / (1 << 20);
+
+	printf("load: %.0f MB\n", size);
+
+	struct Mode { const char* name; bool map_file; unsigned threads; };
+	const Mode modes[] = { { "mapped", true, 0 }, { "mapped 1 thread", true, 1 }, { "fread", false, 1 } };
+
+	for (const Mode& mode : modes) {
+		double best = 1e30;
+
+		for (int run = 0; run < 3; run++) {
+			double start = Now();
+			Database gds(file, mode.map_file, mode.threads);
+
+			best = std::min(best, Now() - start);
+		}
+
+		printf("  %-16s %8.3f s %8.1f MB/s\n", mode.name, best, size / best);
+	}
+}
+
+static bool ReferencedByName(const Database& gds, const Cell& cell)
+{
+	// The scan of every reference of every cell that TopCells did before
+	// the hierarchy graph
+
+	const wchar_t* name = gds.m_names[cell.strname].c_str();
+
+	for (const Cell& other : gds.m_cells) {
+		for (const Aref& aref : other.arefs) {
+			if (wcscmp(gds.m_names[aref.sname].c_str(), name) == 0)
+				return true;
+		}
+		for (const SRef& sref : other.srefs) {
+			if (wcscmp(gds.m_names[sref.sname].c_str(), name) == 0)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static void BenchCells(int argc, wchar_t* argv[])
+{
+	// The hierarchy queries against the old name scan: bench cells [cells
+	// [sampled [file]]]. The scan takes minutes for all cells of a large
+	// library, so it is timed on 'sampled' cells and scaled up.
+
+	unsigned cells = unsigned(ArgNumber(argc, argv, 2, 100000));
+	unsigned sampled = unsigned(ArgNumber(argc, argv, 3, 200));
+	const wchar_t* file = ArgString(argc, argv, 4, L"bench_cells.gds");
+
+	WriteTreeLibrary(file, cells);
+
+	double start = Now();
+	Database gds(file);
+	double load = Now() - start;
+
+	std::vector<std::wstring> names;
+
+	start = Now();
+	gds.TopCells(names);
+	double top = Now() - start;
+
+	printf("cells: %u cells, %zu top cells\n", cells, names.size());
+	printf("  %-24s %10.3f s\n", "load, with the graph", load);
+	printf("  %-24s %10.3f s\n", "TopCells", top);
+
+	std::vector<std::wstring> all, related;
+	size_t links = 0;
+
+	gds.AllCells(all);
+
+	start = Now();
+	for (const std::wstring& name : all) {
+		related.clear();
+		gds.ChildCells(name.c_str(), related);
+		gds.ParentCells(name.c_str(), related);
+		links += related.size();
+	}
+
+	printf("  %-24s %10.3f s (%zu links)\n", "Child and ParentCells", Now() - start, links);
+
+	sampled = std::min(sampled, unsigned(gds.m_cells.size()));
+
+	size_t referenced = 0;
+
+	start = Now();
+	for (unsigned i = 0; i < sampled; i++)
+		referenced += ReferencedByName(gds, gds.m_cells[size_t(i) * gds.m_cells.size() / sampled]);
+
+	double scan = (Now() - start) * gds.m_cells.size() / std::max(1U, sampled);
+
+	printf("  %-24s %10.3f s (scaled from %u cells, %zu referenced)\n", "old TopCells scan", scan, sampled, referenced);
+	printf("  %-24s %10.0fx\n", "TopCells speedup", scan / std::max(top, 1e-9));
+}
+
+struct CountSink : PolySink {
+	void Add(const Pair*, size_t size, uint16_t, uint16_t) override
+	{
+		polys++;
+		pairs += size;
+	}
+
+	uint64_t polys = 0, pairs = 0;
+};
+
+static void BenchFlatten(int argc, wchar_t* argv[])
+{
+	// Flatten and write throughput: bench flatten [instances [file]]
+
+	unsigned instances = unsigned(ArgNumber(argc, argv, 2, 300));
+	const wchar_t* file = ArgString(argc, argv, 3, L"bench_flatten.gds");
+	std::wstring dest = std::wstring(file) + L".out.gds";
+
+	WriteArrayLibrary(file, instances);
+
+	Database gds(file);
+	CountSink count;
+	double start;
+
+	printf("flatten: %u polygons\n", instances * 10000U);
+
+	auto report = [&](const char* name, double seconds, uint64_t polys, long long bytes) {
+		printf("  %-24s %8.3f s %8.2f Mpoly/s", name, seconds, polys / seconds * 1e-6);
+		if (bytes)
+			printf(" %8.1f MB/s", bytes / seconds / (1 << 20));
+		printf("\n");
+	};
+
+	for (unsigned threads : { 1U, 0U }) {
+		const char* suffix = threads == 1 ? ", 1 thread" : "";
+
+		count = CountSink();
+		start = Now();
+		gds.CollapseCell(L"TOP", nullptr, UINT64_MAX, count, threads);
+		report((std::string("to a PolySink") + suffix).c_str(), Now() - start, count.polys, 0);
+
+		start = Now();
+		gds.CollapseCell(L"TOP", nullptr, UINT64_MAX, dest.c_str(), nullptr, threads);
+		report((std::string("to a file") + suffix).c_str(), Now() - start, count.polys, FileSize(dest.c_str()));
+	}
+
+	// The writer on its own, with the polygons already in memory
+	std::vector<Polygon> polys;
+
+	gds.CollapseCell(L"TOP", nullptr, UINT64_MAX, nullptr, &polys);
+
+	for (bool async : { false, true }) {
+		start = Now();
+
+		Writer out(dest.c_str(), async);
+
+		BeginLibrary(out);
+		out.BeginStructure("TOP");
+		for (const Polygon& poly : polys)
+			out.AppendPoly(poly.m_pairs.data(), poly.m_pairs.size(), poly.m_layer);
+		out.EndStructure();
+		out.EndLibrary();
+		out.Close();
+
+		report(async ? "Writer, async" : "Writer", Now() - start, polys.size(), (long long)out.m_written);
+	}
+}
+
+static void BenchKernels(int argc, wchar_t* argv[])
+{
+	// Every kernel on every instruction set of the CPU, on the same input:
+	// bench kernels [pairs]. The results must equal those of the scalar
+	// kernels.
+
+	size_t count = ArgNumber(argc, argv, 2, 4096);
+	size_t reps = std::max(size_t(1), (size_t(1) << 24) / std::max(size_t(1), count));
+
+	// Pseudo random input from a fixed seed
+	uint32_t seed = 12345;
+	auto random = [&]() { seed = seed * 1664525U + 1013904223U; return int32_t(seed >> 4) - (1 << 27); };
+
+	std::vector<Pair> in(count), poly(201), out(count);
+	std::vector<uint8_t> xy(8 * count), inside(count);
+
+	for (size_t i = 0; i < count; i++) {
+		in[i] = { random(), random() };
+
+		for (int k = 0; k < 4; k++) {
+			xy[8 * i + k] = uint8_t(uint32_t(in[i].x) >> (24 - 8 * k));
+			xy[8 * i + 4 + k] = uint8_t(uint32_t(in[i].y) >> (24 - 8 * k));
+		}
+	}
+
+	// A star of 200 vertices over the points, which are sorted on x as
+	// PointsInPoly does for large polygons
+	for (size_t i = 0; i < 200; i++) {
+		double a = 6.283185307179586 * i / 200, r = (i % 2 ? 0.5 : 1.0) * (1 << 27);
+		poly[i] = { int32_t(r * cos(a)), int32_t(r * sin(a)) };
+	}
+	poly[200] = poly[0];
+
+	std::vector<Pair> points(in);
+	std::sort(points.begin(), points.end(), [](const Pair& a, const Pair& b) { return a.x < b.x; });
+
+	const int32_t m[4] = { 0, -1, 1, 0 };
+
+	struct Kernel {
+		const char* name;
+		std::function<void()> run;
+		std::function<std::vector<uint8_t>()> result;
+	};
+
+	auto bytes = [](const void* p, size_t size) {
+		const uint8_t* b = static_cast<const uint8_t*>(p);
+		return std::vector<uint8_t>(b, b + size);
+	};
+
+	Pair box[2];
+
+	const Kernel kernels[] = {
+		{ "decode", [&]() { DecodePairs(out.data(), xy.data(), count); },
+			[&]() { return bytes(out.data(), 8 * count); } },
+		{ "translate", [&]() { TranslatePairs(out.data(), in.data(), count, 1000, -1000); },
+			[&]() { return bytes(out.data(), 8 * count); } },
+		{ "ortho", [&]() { TransformPairs(out.data(), in.data(), count, m, 1000, -1000); },
+			[&]() { return bytes(out.data(), 8 * count); } },
+		{ "affine", [&]() { TransformPairs(out.data(), in.data(), count, 0.8660254037844387, 0.5, 1.5, -1.0, 1000, -1000); },
+			[&]() { return bytes(out.data(), 8 * count); } },
+		{ "bound", [&]() { box[0] = { INT32_MAX, INT32_MAX }; box[1] = { INT32_MIN, INT32_MIN }; BoundPairs(box, in.data(), count); },
+			[&]() { return bytes(box, sizeof(box)); } },
+		{ "inside", [&]() { InsidePairs(poly.data(), poly.size(), points.data(), count, inside.data()); },
+			[&]() { return inside; } },
+	};
+
+	const char* sets[] = { "scalar", "sse4.1", "avx2" };
+	std::string initial = KernelSet();
+	std::vector<std::vector<uint8_t>> expected;
+	bool differ = false;
+
+	printf("kernels: ns per call of %zu pairs (inside: against 200 edges)\n", count);
+	printf("  %-8s", "");
+	for (const Kernel& kernel : kernels)
+		printf(" %10s ", kernel.name);
+	printf("\n");
+
+	for (const char* set : sets) {
+		if (!SetKernelSet(set)) {
+			printf("  %-8s not supported\n", set);
+			continue;
+		}
+
+		printf("  %-8s", set);
+
+		for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+			const Kernel& kernel = kernels[k];
+			size_t runs = strcmp(kernel.name, "inside") == 0 ? std::max(size_t(1), reps / 50) : reps;
+
+			kernel.run();
+
+			double start = Now();
+			for (size_t r = 0; r < runs; r++)
+				kernel.run();
+			double ns = (Now() - start) / runs * 1e9;
+
+			std::vector<uint8_t> result = kernel.result();
+			bool same = true;
+
+			if (expected.size() <= k)
+				expected.push_back(result);
+			else
+				same = result == expected[k];
+
+			differ = differ || !same;
+			printf(" %10.0f%s", ns, same ? " " : "!");
+		}
+
+		printf("\n");
+	}
+
+	SetKernelSet(initial.c_str());
+
+	if (differ)
+		throw std::runtime_error("Results marked ! differ from the scalar kernels");
+
+	printf("  All the results are the same as those of the scalar kernels\n");
+}
+
+static double PolyArea(const Polygon& poly)
+{
+	const std::vector<Pair>& p = poly.m_pairs;
+	double area = 0.0;
+
+	for (size_t i = 0; i + 1 < p.size(); i++)
+		area += double(p[i].x) * p[i + 1].y - double(p[i + 1].x) * p[i].y;
+
+	return std::fabs(area) / 2.0;
+}
+
+static void BenchMerge(int argc, wchar_t* argv[])
+{
+	// Merge and BooleanArea of densely overlapping rectangles: bench merge
+	// [rectangles]. The area of the merged trapezoids must equal that of
+	// the union, and so must the area of their own union.
+
+	size_t count = ArgNumber(argc, argv, 2, 400000);
+
+	// Pseudo random rectangles from a fixed seed, 5 to 50 um wide and tall
+	// in a 1 mm square: about 300 deep on average
+	uint32_t seed = 12345;
+	auto random = [&](uint32_t range) { seed = seed * 1664525U + 1013904223U; return int32_t((seed >> 8) % range); };
+
+	std::vector<Polygon> rects;
+
+	for (size_t i = 0; i < count; i++) {
+		int32_t x = random(1000000), y = random(1000000), w = 5000 + random(45000), h = 5000 + random(45000);
+		Pair p[5] = { { x, y }, { x + w, y }, { x + w, y + h }, { x, y + h }, { x, y } };
+
+		rects.push_back(Polygon(p, 5, 1));
+	}
+
+	printf("merge: %zu rectangles\n", count);
+
+	std::vector<std::pair<uint16_t, double>> areas;
+	double start = Now();
+
+	BooleanArea(rects, std::vector<Polygon>(), BoolOp::OR, areas, 1);
+	printf("  %-24s %8.3f s\n", "BooleanArea, 1 thread", Now() - start);
+
+	double area = areas.empty() ? 0.0 : areas[0].second;
+	std::vector<Polygon> merged;
+
+	for (unsigned threads : { 1U, 0U }) {
+		merged.clear();
+		start = Now();
+		Merge(rects, merged, threads);
+		printf("  %-24s %8.3f s %8zu trapezoids\n", threads == 1 ? "Merge, 1 thread" : "Merge", Now() - start, merged.size());
+	}
+
+	double sum = 0.0;
+
+	for (const Polygon& poly : merged)
+		sum += PolyArea(poly);
+
+	areas.clear();
+	BooleanArea(merged, std::vector<Polygon>(), BoolOp::OR, areas, 0);
+
+	double again = areas.empty() ? 0.0 : areas[0].second;
+
+	printf("  area %.0f, of the trapezoids %.0f, of their union %.0f\n", area, sum, again);
+
+	if (std::fabs(sum - area) > 1e-9 * area || std::fabs(again - area) > 1e-9 * area)
+		throw std::runtime_error("The merged area differs from that of the union");
+}
+
+struct Benchmark {
+	const char* name;
+	void (*run)(int argc, wchar_t* argv[]);
+	const char* usage;
+};
+
+static const Benchmark benchmarks[] = {
+	{ "load", BenchLoad, "[megabytes [file]]  load a generated file mapped and with fread" },
+	{ "kernels", BenchKernels, "[pairs]  every vertex kernel on every instruction set, checked against the scalar ones" },
+	{ "cells", BenchCells, "[cells [sampled [file]]]  TopCells, ChildCells and ParentCells against the old scan" },
+	{ "flatten", BenchFlatten, "[instances [file]]  flatten 10000 polygons per instance to a sink and a file, and Writer alone" },
+	{ "merge", BenchMerge, "[rectangles]  Merge and BooleanArea of densely overlapping rectangles, checking the areas" },
+};
+
+int wmain(int argc, wchar_t* argv[])
+{
+	try
+	{
+		for (const Benchmark& bench : benchmarks) {
+			if (argc >= 2 && std::wstring(argv[1]) == std::wstring(bench.name, bench.name + strlen(bench.name))) {
+				bench.run(argc, argv);
+				return 0;
+			}
+		}
+
+		for (const Benchmark& bench : benchmarks)
+			printf("bench %s %s\n", bench.name, bench.usage);
+	}
+	catch (const std::runtime_error& e)
+	{
+		printf("%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
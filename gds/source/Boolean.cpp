@@ -0,0 +1,781 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "Boolean.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+
+using namespace GDS;
+
+// Edges per band a layer is split in for the parallel tasks
+static const size_t BAND_EDGES = 0x10000;
+
+// Tolerance on x when comparing edges at a y
+static const double X_EPS = 1e-6;
+
+namespace {
+	struct Edge {
+		// A non-horizontal edge from its bottom (x0, y0) to its top (x1, y1)
+
+		int32_t x0, y0, x1, y1;
+
+		// Change of the winding number of its set when crossing the edge
+		// from left to right
+		int8_t wind;
+		uint8_t set; // 0 for a, 1 for b
+
+		// The line it is on: (dx, dy) reduced and c = dy * x - dx * y
+		// (wrapping), the same for all edges on the line
+		int64_t dx, dy;
+		uint64_t c;
+
+		double X(double y) const
+		{
+			if (x0 == x1)
+				return x0;
+
+			return x0 + (y - y0) * (double(x1) - x0) / (double(y1) - y0);
+		}
+
+		bool SameLine(const Edge& e) const
+		{
+			return dx == e.dx && dy == e.dy && c == e.c;
+		}
+	};
+
+	struct Span {
+		// A part of the result in a beam, between two active edges
+
+		uint32_t left, right;
+	};
+
+	struct Trapezoid {
+		// A span carried up over the beams while its edges stay on the same
+		// lines
+
+		uint32_t left, right;
+		double y, xl, xr; // Bottom
+	};
+
+	struct Layer {
+		// The edges of a layer, sorted on their bottom
+
+		uint16_t layer;
+		std::vector<Edge> edges;
+		bool manhattan;
+		bool has[2] = { false, false }; // Whether a and b have edges on it
+		int32_t height; // Of the tallest edge
+	};
+
+	struct CountTree {
+		// A segment tree over x intervals with per node the minimum and
+		// maximum winding number in it (without the additions of its
+		// ancestors) and the addition to all of it
+
+		std::vector<int32_t> low, high, add;
+
+		void Update(size_t node, size_t lo, size_t hi, size_t from, size_t to, int32_t wind)
+		{
+			// Add wind to the intervals [from, to) in node, which has [lo, hi)
+
+			if (to <= lo || hi <= from)
+				return;
+
+			if (from <= lo && hi <= to) {
+				low[node] += wind;
+				high[node] += wind;
+				add[node] += wind;
+				return;
+			}
+
+			size_t mid = (lo + hi) / 2;
+
+			Update(2 * node, lo, mid, from, to, wind);
+			Update(2 * node + 1, mid, hi, from, to, wind);
+
+			low[node] = std::min(low[2 * node], low[2 * node + 1]) + add[node];
+			high[node] = std::max(high[2 * node], high[2 * node + 1]) + add[node];
+		}
+
+		template <typename F>
+		void Runs(size_t node, size_t lo, size_t hi, size_t from, size_t to, int32_t above, F& run) const
+		{
+			// Call run(lo, hi, inside) for the runs of the intervals in
+			// [from, to) in node by whether their winding number is positive;
+			// above is the addition of the ancestors of node
+
+			if (to <= lo || hi <= from)
+				return;
+
+			if (low[node] + above > 0 || high[node] + above <= 0) {
+				run(std::max(lo, from), std::min(hi, to), low[node] + above > 0);
+				return;
+			}
+
+			size_t mid = (lo + hi) / 2;
+
+			Runs(2 * node, lo, mid, from, to, above + add[node], run);
+			Runs(2 * node + 1, mid, hi, from, to, above + add[node], run);
+		}
+	};
+
+	struct Change {
+		// An edge of a Manhattan layer starting or ending at y, at the x
+		// interval boundary x
+
+		int32_t y;
+		uint32_t x;
+		uint8_t set;
+		int8_t wind;
+	};
+
+	struct Task {
+		// A horizontal band of a layer
+
+		const Layer* layer;
+		int32_t y0, y1;
+	};
+}
+
+static int64_t Gcd(int64_t a, int64_t b)
+{
+	a = std::llabs(a);
+	b = std::llabs(b);
+
+	while (b) {
+		int64_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+static void AddEdges(const Polygon& poly, uint8_t set, std::vector<Edge>& edges)
+{
+	// Add the non-horizontal edges of a polygon, with the winding change set
+	// so that its inside counts +1 whatever its orientation
+
+	const std::vector<Pair>& p = poly.m_pairs;
+	size_t n = p.size();
+
+	// The closing point is not needed
+	if (n > 1 && p[0].x == p[n - 1].x && p[0].y == p[n - 1].y)
+		n--;
+
+	if (n < 3)
+		return;
+
+	double area = 0.0;
+
+	for (size_t i = 0; i < n; i++) {
+		const Pair& a = p[i];
+		const Pair& b = p[(i + 1) % n];
+
+		area += double(a.x) * b.y - double(b.x) * a.y;
+	}
+
+	if (area == 0.0)
+		return;
+
+	int8_t sign = area > 0.0 ? 1 : -1;
+
+	for (size_t i = 0; i < n; i++) {
+		const Pair& a = p[i];
+		const Pair& b = p[(i + 1) % n];
+
+		if (a.y == b.y)
+			continue;
+
+		// Inside a counter clockwise polygon is left of its edges, so the
+		// downward edges are entered from the left
+		bool down = b.y < a.y;
+		const Pair& lo = down ? b : a;
+		const Pair& hi = down ? a : b;
+
+		Edge e;
+
+		e.x0 = lo.x;
+		e.y0 = lo.y;
+		e.x1 = hi.x;
+		e.y1 = hi.y;
+		e.wind = int8_t(down ? sign : -sign);
+		e.set = set;
+
+		int64_t dx = int64_t(hi.x) - lo.x, dy = int64_t(hi.y) - lo.y;
+		int64_t g = Gcd(dx, dy);
+
+		e.dx = dx / g;
+		e.dy = dy / g;
+		e.c = uint64_t(e.dy) * uint64_t(int64_t(lo.x)) - uint64_t(e.dx) * uint64_t(int64_t(lo.y));
+
+		edges.push_back(e);
+	}
+}
+
+static bool Inside(BoolOp op, int wa, int wb)
+{
+	bool a = wa > 0, b = wb > 0;
+
+	switch (op) {
+	case BoolOp::OR:
+		return a || b;
+	case BoolOp::AND:
+		return a && b;
+	case BoolOp::NOT:
+		return a && !b;
+	case BoolOp::XOR:
+		return a != b;
+	}
+
+	return false;
+}
+
+static void EmitTrapezoid(const std::vector<Edge>& edges, const Trapezoid& t, double top, uint16_t layer, std::vector<Polygon>& out)
+{
+	int32_t yb = int32_t(llround(t.y)), yt = int32_t(llround(top));
+
+	if (yb == yt)
+		return;
+
+	Pair corners[4] = {
+		{ int32_t(llround(t.xl)), yb },
+		{ int32_t(llround(t.xr)), yb },
+		{ int32_t(llround(edges[t.right].X(top))), yt },
+		{ int32_t(llround(edges[t.left].X(top))), yt }
+	};
+
+	// Leave out the corners of the sides that shrank to a point
+	Pair pairs[5];
+	size_t n = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (n == 0 || corners[i].x != pairs[n - 1].x || corners[i].y != pairs[n - 1].y)
+			pairs[n++] = corners[i];
+	}
+
+	if (n > 1 && pairs[n - 1].x == pairs[0].x && pairs[n - 1].y == pairs[0].y)
+		n--;
+
+	if (n < 3)
+		return;
+
+	pairs[n++] = pairs[0];
+
+	out.push_back(Polygon(pairs, n, layer));
+}
+
+static void SortActive(const std::vector<Edge>& edges, std::vector<uint32_t>& active, double y, std::vector<double>& keys)
+{
+	// Insertion sort of the active edges on their x at y, ties on the index;
+	// the order changes little from beam to beam
+
+	keys.resize(active.size());
+
+	for (size_t i = 0; i < active.size(); i++)
+		keys[i] = edges[active[i]].X(y);
+
+	for (size_t i = 1; i < active.size(); i++) {
+		uint32_t e = active[i];
+		double key = keys[i];
+		size_t j = i;
+
+		for (; j > 0 && (keys[j - 1] > key || (keys[j - 1] == key && active[j - 1] > e)); j--) {
+			active[j] = active[j - 1];
+			keys[j] = keys[j - 1];
+		}
+
+		active[j] = e;
+		keys[j] = key;
+	}
+}
+
+static double SplitBeam(const std::vector<Edge>& edges, const std::vector<uint32_t>& active, double bottom, double top)
+{
+	// The lowest y in (bottom, top) where two neighbouring active edges,
+	// sorted at the middle of the beam, cross; top if none do
+
+	double split = top;
+
+	for (size_t i = 0; i + 1 < active.size(); i++) {
+		const Edge& e = edges[active[i]];
+		const Edge& f = edges[active[i + 1]];
+
+		double d0 = f.X(bottom) - e.X(bottom);
+		double d1 = f.X(top) - e.X(top);
+
+		// Sorted at the middle, they cross below it if out of order at the
+		// bottom, or above it if out of order at the top
+		if (d0 < -X_EPS || d1 < -X_EPS) {
+			double y = bottom + (top - bottom) * d0 / (d0 - d1);
+
+			if (y > bottom && y < split)
+				split = y;
+		}
+	}
+
+	return split;
+}
+
+static void ScanBand(const Task& task, BoolOp op, std::vector<Polygon>* out, double& area)
+{
+	// Scan a band of a layer with edges at other angles bottom up in beams
+	// between the y of the edge ends, split further where edges cross. The spans of the result in a
+	// beam are carried on from the beam below when bounded by the same lines.
+	// Without out only their area is summed.
+
+	const std::vector<Edge>& edges = task.layer->edges;
+	uint16_t layer = task.layer->layer;
+
+	// The edges overlapping the band, in order of their bottom; no edge
+	// starting below y0 - height reaches the band
+	std::vector<uint32_t> band;
+	std::vector<double> events = { double(task.y0), double(task.y1) };
+
+	int32_t from = int32_t(std::max(int64_t(INT_MIN), int64_t(task.y0) - task.layer->height));
+	uint32_t first = uint32_t(std::lower_bound(edges.begin(), edges.end(), from, [](const Edge& e, int32_t y) { return e.y0 < y; }) - edges.begin());
+
+	for (uint32_t i = first; i < edges.size() && edges[i].y0 < task.y1; i++) {
+		const Edge& e = edges[i];
+
+		if (e.y1 <= task.y0)
+			continue;
+
+		band.push_back(i);
+
+		if (e.y0 > task.y0)
+			events.push_back(e.y0);
+		if (e.y1 < task.y1)
+			events.push_back(e.y1);
+	}
+
+	std::sort(events.begin(), events.end());
+	events.erase(std::unique(events.begin(), events.end()), events.end());
+
+	std::vector<uint32_t> active;
+	std::vector<double> keys;
+	std::vector<Span> spans;
+	std::vector<Trapezoid> open, next;
+	size_t pending = 0;
+
+	for (size_t k = 0; k + 1 < events.size(); k++) {
+		double bottom = events[k];
+
+		while (bottom < events[k + 1]) {
+			double top = events[k + 1];
+
+			// Drop the edges ending at the bottom and add those starting there
+			size_t kept = 0;
+
+			for (size_t i = 0; i < active.size(); i++) {
+				if (edges[active[i]].y1 > bottom)
+					active[kept++] = active[i];
+			}
+			active.resize(kept);
+
+			for (; pending < band.size() && std::max(edges[band[pending]].y0, task.y0) <= bottom; pending++)
+				active.push_back(band[pending]);
+
+			SortActive(edges, active, (bottom + top) / 2.0, keys);
+
+			// Edges may cross in the beam: lower its top to the first crossing
+			// until none is left
+			for (;;) {
+				double split = SplitBeam(edges, active, bottom, top);
+
+				if (split == top)
+					break;
+
+				top = split;
+				SortActive(edges, active, (bottom + top) / 2.0, keys);
+			}
+
+			// The spans where the result is inside
+			int wind[2] = { 0, 0 };
+			bool inside = false;
+			uint32_t left = 0;
+
+			spans.clear();
+
+			for (uint32_t e : active) {
+				wind[edges[e].set] += edges[e].wind;
+
+				bool now = Inside(op, wind[0], wind[1]);
+
+				if (now && !inside)
+					left = e;
+				else if (!now && inside)
+					spans.push_back({ left, e });
+
+				inside = now;
+			}
+
+			// Without output only the area of the spans is needed; they are
+			// trapezoids, as wide as at the middle on average
+			if (!out) {
+				double middle = (bottom + top) / 2.0;
+
+				for (const Span& s : spans)
+					area += (edges[s.right].X(middle) - edges[s.left].X(middle)) * (top - bottom);
+
+				bottom = top;
+				continue;
+			}
+
+			// Carry on the trapezoids bounded by the same lines and close the
+			// others; both lists are in order of x
+			next.clear();
+
+			size_t j = 0;
+
+			for (const Span& s : spans) {
+				const Edge& l = edges[s.left];
+				const Edge& r = edges[s.right];
+				double xl = l.X(bottom), xr = r.X(bottom);
+
+				if (xr - xl <= X_EPS && r.X(top) - l.X(top) <= X_EPS)
+					continue;
+
+				bool carried = false;
+
+				for (; j < open.size() && edges[open[j].left].X(bottom) <= xl + X_EPS; j++) {
+					Trapezoid& t = open[j];
+
+					if (edges[t.left].SameLine(l) && edges[t.right].SameLine(r)) {
+						t.left = s.left;
+						t.right = s.right;
+						next.push_back(t);
+						carried = true;
+						j++;
+						break;
+					}
+
+					EmitTrapezoid(edges, t, bottom, layer, *out);
+				}
+
+				if (!carried)
+					next.push_back({ s.left, s.right, bottom, xl, xr });
+			}
+
+			for (; j < open.size(); j++)
+				EmitTrapezoid(edges, open[j], bottom, layer, *out);
+
+			open.swap(next);
+			bottom = top;
+		}
+	}
+
+	for (const Trapezoid& t : open)
+		EmitTrapezoid(edges, t, double(task.y1), layer, *out);
+}
+
+static void InsideRuns(const CountTree* trees, size_t size, BoolOp op, size_t from, size_t to, std::vector<std::pair<size_t, size_t>>& runs)
+{
+	// The runs of the x intervals in [from, to) where the result is inside
+
+	runs.clear();
+
+	auto inner = [&](size_t lo, size_t hi, bool a, bool b) {
+		if (!Inside(op, a, b))
+			return;
+
+		if (!runs.empty() && runs.back().second == lo)
+			runs.back().second = hi;
+		else
+			runs.push_back({ lo, hi });
+	};
+
+	auto outer = [&](size_t lo, size_t hi, bool a) {
+		auto run = [&](size_t l, size_t h, bool b) { inner(l, h, a, b); };
+
+		trees[1].Runs(1, 0, size, lo, hi, 0, run);
+	};
+
+	trees[0].Runs(1, 0, size, from, to, 0, outer);
+}
+
+static void ScanManhattan(const Task& task, BoolOp op, std::vector<Polygon>* out, double& area)
+{
+	// Scan a band of a Manhattan layer bottom up with the winding numbers of
+	// the x intervals between its edges in a segment tree per set. Where
+	// edges start or end only the x intervals up to where their changes
+	// cancel out are updated, and only the rectangles of the result touching
+	// those are closed and opened again; a rectangle keeping its x extent is
+	// carried on. Without out only the width inside is kept, for the area.
+
+	const std::vector<Edge>& edges = task.layer->edges;
+	uint16_t layer = task.layer->layer;
+
+	std::vector<int32_t> xs;
+	std::vector<Change> changes;
+
+	int32_t from = int32_t(std::max(int64_t(INT_MIN), int64_t(task.y0) - task.layer->height));
+	uint32_t first = uint32_t(std::lower_bound(edges.begin(), edges.end(), from, [](const Edge& e, int32_t y) { return e.y0 < y; }) - edges.begin());
+	uint32_t last = first;
+
+	for (; last < edges.size() && edges[last].y0 < task.y1; last++) {
+		if (edges[last].y1 > task.y0)
+			xs.push_back(edges[last].x0);
+	}
+
+	std::sort(xs.begin(), xs.end());
+	xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+
+	if (xs.size() < 2)
+		return;
+
+	for (uint32_t i = first; i < last; i++) {
+		const Edge& e = edges[i];
+
+		if (e.y1 <= task.y0)
+			continue;
+
+		uint32_t x = uint32_t(std::lower_bound(xs.begin(), xs.end(), e.x0) - xs.begin());
+
+		changes.push_back({ std::max(e.y0, task.y0), x, e.set, e.wind });
+		changes.push_back({ std::min(e.y1, task.y1), x, e.set, int8_t(-e.wind) });
+	}
+
+	std::sort(changes.begin(), changes.end(), [](const Change& c, const Change& d) { return c.y < d.y || (c.y == d.y && c.x < d.x); });
+
+	size_t leaves = xs.size() - 1, size = 1;
+
+	while (size < leaves)
+		size *= 2;
+
+	CountTree trees[2];
+
+	for (CountTree& tree : trees) {
+		tree.low.assign(2 * size, 0);
+		tree.high.assign(2 * size, 0);
+		tree.add.assign(2 * size, 0);
+	}
+
+	// The open rectangles by left x, with their right x and bottom
+	std::map<int32_t, std::pair<int32_t, int32_t>> open;
+	std::vector<std::pair<size_t, size_t>> before, after;
+	double width = 0.0;
+	int32_t y = changes[0].y;
+
+	for (size_t i = 0; i < changes.size();) {
+		int32_t at = changes[i].y;
+		size_t end = i;
+
+		while (end < changes.size() && changes[end].y == at)
+			end++;
+
+		area += width * (double(at) - y);
+		y = at;
+
+		while (i < end) {
+			// The changes up to an x where they cancel out for both sets,
+			// beyond which the winding numbers stay the same
+			int32_t wind[2] = { 0, 0 };
+			size_t j = i;
+
+			do {
+				uint32_t x = changes[j].x;
+
+				for (; j < end && changes[j].x == x; j++)
+					wind[changes[j].set] += changes[j].wind;
+			} while (j < end && (wind[0] != 0 || wind[1] != 0));
+
+			size_t lo = changes[i].x, hi = changes[j - 1].x;
+
+			if (lo == hi) {
+				i = j;
+				continue;
+			}
+
+			if (!out)
+				InsideRuns(trees, size, op, lo, hi, before);
+
+			wind[0] = wind[1] = 0;
+
+			while (i < j) {
+				uint32_t x = changes[i].x;
+
+				for (; i < j && changes[i].x == x; i++)
+					wind[changes[i].set] += changes[i].wind;
+
+				for (int set = 0; set < 2; set++) {
+					if (wind[set] != 0 && i < j)
+						trees[set].Update(1, 0, size, x, changes[i].x, wind[set]);
+				}
+			}
+
+			if (!out) {
+				InsideRuns(trees, size, op, lo, hi, after);
+
+				for (const auto& run : after)
+					width += double(xs[run.second]) - xs[run.first];
+				for (const auto& run : before)
+					width -= double(xs[run.second]) - xs[run.first];
+
+				continue;
+			}
+
+			// The open rectangles touching the changed intervals, and the
+			// result over them and these
+			auto it = open.upper_bound(xs[hi]);
+			auto begin = it;
+
+			while (begin != open.begin() && std::prev(begin)->second.first >= xs[lo])
+				begin--;
+
+			if (begin != it) {
+				lo = std::min(lo, size_t(std::lower_bound(xs.begin(), xs.end(), begin->first) - xs.begin()));
+				hi = std::max(hi, size_t(std::lower_bound(xs.begin(), xs.end(), std::prev(it)->second.first) - xs.begin()));
+			}
+
+			InsideRuns(trees, size, op, lo, hi, after);
+
+			// Close those not in the result as they are, then open the new ones
+			auto next = after.begin();
+
+			while (begin != it) {
+				int32_t left = begin->first, right = begin->second.first, bottom = begin->second.second;
+
+				while (next != after.end() && xs[next->first] < left)
+					next++;
+
+				if (next != after.end() && xs[next->first] == left && xs[next->second] == right) {
+					begin++;
+					continue;
+				}
+
+				if (bottom != at) {
+					Pair p[5] = { { left, bottom }, { right, bottom }, { right, at }, { left, at }, { left, bottom } };
+
+					out->push_back(Polygon(p, 5, layer));
+				}
+
+				begin = open.erase(begin);
+			}
+
+			// Those carried on are there already
+			for (const auto& run : after)
+				open.insert({ xs[run.first], { xs[run.second], at } });
+		}
+	}
+}
+
+static void SplitTasks(const std::vector<Polygon>& a, const std::vector<Polygon>& b, BoolOp op, std::map<uint16_t, Layer>& layers, std::vector<Task>& tasks)
+{
+	// The edges of both sets by layer, for the layers the result can be on
+	const std::vector<Polygon>* sets[2] = { &a, &b };
+
+	for (uint8_t set = 0; set < 2; set++) {
+		for (const Polygon& poly : *sets[set]) {
+			if (set == 1 && op != BoolOp::OR && op != BoolOp::XOR && layers.find(poly.m_layer) == layers.end())
+				continue;
+
+			Layer& layer = layers[poly.m_layer];
+			size_t size = layer.edges.size();
+
+			layer.layer = poly.m_layer;
+			AddEdges(poly, set, layer.edges);
+			layer.has[set] = layer.has[set] || layer.edges.size() > size;
+		}
+	}
+
+	// Split the layers in bands of about BAND_EDGES edge bottoms
+	for (auto& it : layers) {
+		Layer& layer = it.second;
+		std::vector<Edge>& edges = layer.edges;
+
+		// The result of AND is empty where one set is
+		if (edges.empty() || (op == BoolOp::AND && !(layer.has[0] && layer.has[1])))
+			continue;
+
+		std::sort(edges.begin(), edges.end(), [](const Edge& e, const Edge& f) {
+			return e.y0 < f.y0 || (e.y0 == f.y0 && (e.x0 < f.x0 || (e.x0 == f.x0 && e.y1 < f.y1)));
+		});
+
+		layer.manhattan = std::all_of(edges.begin(), edges.end(), [](const Edge& e) { return e.x0 == e.x1; });
+
+		int32_t top = edges[0].y1;
+
+		layer.height = 0;
+
+		for (const Edge& e : edges) {
+			top = std::max(top, e.y1);
+			layer.height = std::max(layer.height, e.y1 - e.y0);
+		}
+
+		int32_t y = edges[0].y0;
+
+		for (size_t i = BAND_EDGES; i < edges.size(); i += BAND_EDGES) {
+			if (edges[i].y0 > y) {
+				tasks.push_back({ &layer, y, edges[i].y0 });
+				y = edges[i].y0;
+			}
+		}
+
+		tasks.push_back({ &layer, y, top });
+	}
+}
+
+void GDS::Boolean(const std::vector<Polygon>& a, const std::vector<Polygon>& b, BoolOp op, std::vector<Polygon>& out, unsigned threads)
+{
+	std::map<uint16_t, Layer> layers;
+	std::vector<Task> tasks;
+
+	SplitTasks(a, b, op, layers, tasks);
+
+	std::vector<std::vector<Polygon>> results(tasks.size());
+
+	RunTasks(tasks.size(), threads, [&](size_t k) {
+		double area = 0.0;
+
+		if (tasks[k].layer->manhattan)
+			ScanManhattan(tasks[k], op, &results[k], area);
+		else
+			ScanBand(tasks[k], op, &results[k], area);
+	});
+
+	for (std::vector<Polygon>& result : results)
+		out.insert(out.end(), result.begin(), result.end());
+}
+
+void GDS::BooleanArea(const std::vector<Polygon>& a, const std::vector<Polygon>& b, BoolOp op, std::vector<std::pair<uint16_t, double>>& areas, unsigned threads)
+{
+	std::map<uint16_t, Layer> layers;
+	std::vector<Task> tasks;
+
+	SplitTasks(a, b, op, layers, tasks);
+
+	std::vector<double> results(tasks.size(), 0.0);
+
+	RunTasks(tasks.size(), threads, [&](size_t k) {
+		if (tasks[k].layer->manhattan)
+			ScanManhattan(tasks[k], op, nullptr, results[k]);
+		else
+			ScanBand(tasks[k], op, nullptr, results[k]);
+	});
+
+	for (size_t k = 0; k < tasks.size(); k++) {
+		uint16_t layer = tasks[k].layer->layer;
+
+		if (areas.empty() || areas.back().first != layer)
+			areas.push_back({ layer, 0.0 });
+
+		areas.back().second += results[k];
+	}
+}
+
+void GDS::Merge(const std::vector<Polygon>& polys, std::vector<Polygon>& out, unsigned threads)
+{
+	Boolean(polys, std::vector<Polygon>(), BoolOp::OR, out, threads);
+}
@@ -0,0 +1,40 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#pragma once
+
+#include "Polygon.h"
+
+#include <utility>
+#include <vector>
+
+namespace GDS {
+
+	enum class BoolOp { OR, AND, NOT, XOR };
+
+	// Boolean operation between the polygons of a and those of b, layer by
+	// layer, with a scanline over the edges. The polygons may overlap and have
+	// either orientation; a point is in a set if a polygon of it covers it.
+	//
+	// The result on a layer is appended to out as non-overlapping trapezoids
+	// with horizontal bottom and top edges, each as tall as the edges bounding
+	// it allow; for Manhattan input these are rectangles. Where edges at
+	// other angles cross, the vertices are rounded to the nearest integer.
+	//
+	// Layers, and horizontal bands of large layers, are done in parallel on up
+	// to 'threads' threads (0 for one per hardware thread); the result does
+	// not depend on the number of threads.
+	void Boolean(const std::vector<Polygon>& a, const std::vector<Polygon>& b, BoolOp op, std::vector<Polygon>& out, unsigned threads = 1);
+
+	// The area of the result of Boolean per layer, in order of layer, without
+	// making the trapezoids; only layers the result can be on are listed
+	void BooleanArea(const std::vector<Polygon>& a, const std::vector<Polygon>& b, BoolOp op, std::vector<std::pair<uint16_t, double>>& areas, unsigned threads = 1);
+
+	// The union of the polygons per layer, as Boolean(polys, {}, OR)
+	void Merge(const std::vector<Polygon>& polys, std::vector<Polygon>& out, unsigned threads = 1);
+}
@@ -10,8 +10,27 @@
 
 #include "Gds.h"
 #include "GdsRecords.h"
+#include "Boolean.h"
+#include "Kernels.h"
+#include "PolyIndex.h"
+#include "Raster.h"
 #include "StringConverter.h"
-
+#include "TaskPool.h"
+#include "Writer.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <stdexcept>
 
 const double M_PI = 3.14159265358979323846;
@@ -29,6 +48,89 @@ namespace GDS {
 		int32_t x = 0, y = 0;
 		double mag = 1.0, angle = 0.0;
 		uint16_t mirror = 0;
+
+		// The form the parameters reduce to, set by ClassifyTransform: a pure
+		// translation, an integer matrix m for the orthogonal angles at an
+		// integer mag, or else the cosine and sine of the angle.
+		enum Kind : uint8_t { TRANSLATE, ORTHO, AFFINE } kind = TRANSLATE;
+		int32_t m[4] = { 1, 0, 0, 1 };
+		double cos_a = 1.0, sin_a = 0.0;
+	};
+
+	struct PolyBuffer {
+		// Polygons collected by a parallel flattening task
+
+		std::vector<Pair> pairs;
+		std::vector<uint32_t> sizes;
+		std::vector<uint16_t> layers;
+		std::vector<uint16_t> datatypes;
+	};
+
+	struct Scratch {
+		// Buffers of a thread, reused by all the polygons it flattens so that
+		// polygons of any size need no allocation per call
+
+		std::vector<Pair> out, path;
+		std::vector<Line> mline, pline;
+		std::vector<Pair> clip[2];
+	};
+
+	struct FlattenCache {
+		// Flattened polygons of cells in their own coordinates, evicted in
+		// least recently used order when over max_bytes.
+
+		size_t max_bytes = 0, bytes = 0;
+
+		// Estimated size and polygon count of every flattened cell, to leave
+		// out the large ones
+		std::vector<double> estimates, polys;
+
+		// Number of references in every flattened cell that are not at a
+		// multiple of 90 degrees and an integer mag. Only cells without any
+		// are cached, as transforming their polygons again is exact.
+		std::vector<double> inexact;
+
+		// Cells visited before; a cell is cached on its second visit
+		std::vector<uint8_t> seen;
+
+		std::mutex lock;
+		std::list<uint32_t> lru; // Most recently used first
+		std::unordered_map<uint32_t, std::pair<std::shared_ptr<const PolyBuffer>, std::list<uint32_t>::iterator>> cells;
+	};
+
+	struct DensityTile {
+		// The polygons on a layer in a density tile, cut to the tile
+
+		bool full = false; // One of them covers all of the tile
+		std::vector<Pair> pairs;
+		std::vector<uint32_t> sizes;
+		size_t merged = 0; // Pairs left by the last merge
+	};
+
+	struct DensityGrid {
+		// The tiles of Database::CollapseDensity by tile * 0x10000 + layer,
+		// in stripes with a lock each
+
+		static const size_t STRIPES = 64;
+
+		// The edges of the tiles, cols + 1 along x and rows + 1 along y
+		std::vector<int32_t> xs, ys;
+		unsigned cols, rows;
+
+		std::mutex locks[STRIPES];
+		std::unordered_map<uint64_t, DensityTile> tiles[STRIPES];
+	};
+
+	struct DensityPart {
+		// The polygons a thread cut to the tiles, added to the grid when
+		// there are many and at the end
+
+		DensityGrid* grid;
+
+		// The polygons one after the other, and the key of their tile with
+		// their size; size 0 for a tile covered all over
+		std::vector<Pair> pairs;
+		std::vector<std::pair<uint64_t, uint32_t>> polys;
 	};
 
 	struct Recdata {
@@ -40,14 +142,162 @@ namespace GDS {
 
 		Pair bbox[5];
 
-		FILE* poutfile;
+		Writer* pwriter;
 		std::vector<Polygon>* pset;
+		PolyBuffer* pbuf;
+		PolySink* psink;
+		DensityPart* density;
+
+		FlattenCache* cache;
+
+		bool clip; // Cut the polygons to bbox (if usebbox)
+	};
+
+	struct FlattenTask {
+		// Part of the hierarchy flattened by one parallel task: the whole
+		// subtree of a transformed cell or only its own elements.
+
+		Cell* cell;
+		Transform tra;
+		bool elements_only;
+		double polys; // Estimated number of polygons
+	};
+
+	struct Frame {
+		// A cell on the explicit stack of a flatten, with the position in it
+		// to go on from.
+
+		Cell* cell;
+		Transform tra;
+
+		// The cached polygons of the cell, which replace its elements if set
+		std::shared_ptr<const PolyBuffer> cached;
+
+		// Next BOUNDARY/PATH element (boundaries first) or cached polygon, and
+		// the offset of the pairs of the next cached polygon
+		size_t element = 0, offset = 0;
+
+		// Next SREF, AREF and reference in that AREF (col * rows + row)
+		size_t sref = 0, aref = 0, ref = 0;
+
+		// Transformation shared by the references of the current AREF
+		Transform aref_tra;
+	};
+
+	struct FlattenState {
+		// Where a FlattenIterator goes on from
+
+		Recdata data{};
+		std::vector<Frame> stack;
+	};
+
+	struct WindowIndex {
+		// Trees over the elements and references of the cells, each built on
+		// the first query visiting the cell. The ids in a tree are those of
+		// the boundaries, paths, SREFs and AREFs of the cell, in that order.
+
+		std::mutex lock;
+		std::vector<std::unique_ptr<BoxTree>> trees;
+	};
+
+	struct WindowFrame {
+		// A cell on the stack of a window query
+
+		uint32_t cell;
+		Transform tra;
+
+		// Elements and references possibly overlapping the window, in order
+		std::vector<size_t> ids;
+		size_t next = 0;
+
+		// The AREF being expanded, its references possibly overlapping the
+		// window (col * rows + row) and the next one
+		size_t aref = 0;
+		std::vector<uint32_t> refs;
+		size_t next_ref = 0;
+		Transform aref_tra;
+	};
+
+	struct RasterSink : WindowSink {
+		// Collects the polygons of a raster tile on the selected layers, cut
+		// to the tile
+
+		void Add(const InstanceStep*, size_t, const Pair* pairs, size_t size, uint16_t layer, uint16_t datatype) override;
+
+		const LayerFilter* layers;
+
+		Pair bbox[3];
+		std::vector<Pair> buf;
+
+		// The polygons one after the other, and where each starts followed
+		// by the end of the last
+		std::vector<Pair> pairs;
+		std::vector<size_t> offsets = { 0 };
+	};
+
+	struct Parser {
+		// State of the GDS record decoder.
+
+		Database* gds;
+		std::vector<Cell>* cells; // Destination of the structures read
+
+		enum STR_TYPE
+		{
+			NONE,
+			BRY,
+			PATH,
+			SREF,
+			AREF
+		} curElem = NONE;
+
+		// Current GDS structure being read
+		Cell curCell = {};
+
+		// The different elements
+		Bndry curBndry = {};
+		Path curPath = {};
+		SRef curSRef = {};
+		Aref curARef = {};
+
+		// The vertices of the current BOUNDARY or PATH were skipped, as its
+		// layer is not selected
+		bool skipElem = false;
+
+		// Names interned by this parser, merged into Database::m_names when done
+		std::vector<std::string> names = { std::string() };
+		std::unordered_map<std::string, uint32_t> nameIndex = { { std::string(), 0 } };
+		std::string key;
+
+		// Offset of the current record and number of cells read
+		uint64_t offset = 0;
+		uint64_t cell_count = 0;
+
+		bool readEndlib = false;
+	};
+
+	struct StructRange {
+		// Byte range of a BGNSTR..ENDSTR block in the file
+
+		size_t begin, end;
+	};
+
+	struct MappedFile {
+		// Read-only view of a complete file, released on destruction.
+
+		~MappedFile();
+		bool Open(const wchar_t* path);
+
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+
+		const uint8_t* data = nullptr;
+		size_t size = 0;
 	};
 }
 
 using namespace GDS;
 
-static double BufReadFloat(uint8_t* p)
+static double BufReadFloat(const uint8_t* p)
 {
 	int i, sign, exp;
 	double fraction;
@@ -96,153 +346,349 @@ static Pair SumPairs(Pair one, Pair two)
 	return out;
 }
 
-// Functions to add data to the output file
-
-static void FileAppendBytes(FILE* file, uint16_t record, uint8_t* data, size_t len)
+static void ClassifyTransform(Transform& tra)
 {
-	uint8_t buf[4];
+	// Reduce the transformation to the cheapest exact form
+
+	double quarters = tra.angle / 90.0;
 
-	buf[0] = uint8_t(((len + 4) >> 8) & 0xFF);
-	buf[1] = uint8_t((len + 4) & 0xFF);
-	buf[2] = uint8_t((record >> 8) & 0xFF);
-	buf[3] = uint8_t(record & 0xFF);
+	if (quarters == floor(quarters) && tra.mag == floor(tra.mag) && tra.mag >= 1.0 && tra.mag <= 65536.0) {
+		static const int32_t cos_sin[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+
+		int q = int(fmod(quarters, 4.0));
+		int32_t k = int32_t(tra.mag);
+		int32_t sign = tra.mirror ? -1 : 1;
+
+		if (q < 0)
+			q += 4;
+
+		int32_t c = k * cos_sin[q][0], s = k * cos_sin[q][1];
+
+		tra.m[0] = c;
+		tra.m[1] = -sign * s;
+		tra.m[2] = s;
+		tra.m[3] = sign * c;
+		tra.kind = (q == 0 && k == 1 && !tra.mirror) ? Transform::TRANSLATE : Transform::ORTHO;
+	}
+	else {
+		double angle_rad = M_PI * tra.angle / 180.0;
+
+		tra.cos_a = cos(angle_rad);
+		tra.sin_a = sin(angle_rad);
+		tra.kind = Transform::AFFINE;
+	}
+}
 
-	fwrite(buf, 4, 1, file);
-	fwrite(data, len, 1, file);
+static void TransformPoly(Pair* pout, const Pair* pin, size_t size, const Transform& tra)
+{
+	if (tra.kind == Transform::TRANSLATE)
+		TranslatePairs(pout, pin, size, tra.x, tra.y);
+	else if (tra.kind == Transform::ORTHO)
+		TransformPairs(pout, pin, size, tra.m, tra.x, tra.y);
+	else // The reflection with respect to the x axis comes before the rotation
+		TransformPairs(pout, pin, size, tra.cos_a, tra.sin_a, tra.mag, tra.mirror ? -1.0 : 1.0, tra.x, tra.y);
 }
 
-static void FileAppendRecord(FILE* file, uint16_t record)
+static Pair TransformOffset(const Transform& tra, int32_t x, int32_t y)
 {
-	uint8_t buf[4];
+	// Origin of a cell referenced at (x, y) from a cell transformed by tra
+
+	if (tra.kind != Transform::AFFINE) {
+		Pair in = { x, y }, out;
+
+		TransformPoly(&out, &in, 1, tra);
+		return out;
+	}
 
-	buf[0] = 0;
-	buf[1] = 4;
-	buf[2] = uint8_t((record >> 8) & 0xFF);
-	buf[3] = uint8_t(record & 0xFF);
+	double sign = tra.mirror ? -1.0 : 1.0;
+	Pair out = { tra.x + (int)(tra.mag * (x * tra.cos_a - sign * y * tra.sin_a)),
+		tra.y + (int)(tra.mag * (x * tra.sin_a + sign * y * tra.cos_a)) };
 
-	fwrite(buf, 4, 1, file);
+	return out;
 }
 
-static void FileAppendShort(FILE* file, uint16_t record, uint16_t data)
+static Transform AccumulateTransform(const Transform& tra, int32_t x, int32_t y, uint16_t strans, double mag, double angle)
 {
-	uint8_t buf[6];
+	// Transformation of a cell referenced at (x, y) with the given STRANS,
+	// MAG and ANGLE from a cell that is itself transformed by tra.
+
+	Transform out;
+	double sign = tra.mirror ? -1.0 : 1.0;
+
+	// Origin of the cell being referenced in the reference frame of the top
+	// cell (so after transformations)
+	Pair origin = TransformOffset(tra, x, y);
+
+	out.x = origin.x;
+	out.y = origin.y;
 
-	buf[0] = 0;
-	buf[1] = 6;
-	buf[2] = uint8_t((record >> 8) & 0xFF);
-	buf[3] = uint8_t(record & 0xFF);
+	// The reflection of tra is applied after the rotation of the reference,
+	// which reverses its direction
+	out.mag = tra.mag * mag;
+	out.angle = tra.angle + sign * angle;
+	out.mirror = static_cast<uint16_t> (tra.mirror ^ (strans & 0x8000));
 
-	buf[4] = uint8_t((data >> 8) & 0xFF);
-	buf[5] = uint8_t(data & 0xFF);
+	ClassifyTransform(out);
 
-	fwrite(buf, 6, 1, file);
+	return out;
 }
 
-static void FileAppendString(FILE* file, uint16_t record, const char* string)
+static Pair ArefOrigin(const Aref* p, int col, int row)
 {
-	uint8_t buf[4];
-	size_t text_len, record_len;
+	// Origin of the cell being referenced at (col, row) in the reference
+	// frame of the aref
+
+	int64_t dx_col = int64_t(p->x2) - p->x1, dy_col = int64_t(p->y2) - p->y1;
+	int64_t dx_row = int64_t(p->x3) - p->x1, dy_row = int64_t(p->y3) - p->y1;
+
+	// Exact when the pitches are whole, which they are in practice
+	if (dx_col % p->col == 0 && dy_col % p->col == 0 && dx_row % p->row == 0 && dy_row % p->row == 0) {
+		Pair out = { int32_t(p->x1 + col * (dx_col / p->col) + row * (dx_row / p->row)),
+			int32_t(p->y1 + col * (dy_col / p->col) + row * (dy_row / p->row)) };
+
+		return out;
+	}
 
-	text_len = strlen(string);
+	// (v_col_x, v_col_y) vector in column direction
+	double v_col_x = double(dx_col) / p->col;
+	double v_col_y = double(dy_col) / p->col;
 
-	record_len = text_len;
-	if (text_len % 2) record_len++;
+	// (v_row_x, v_row_y) vector in row direction
+	double v_row_x = double(dx_row) / p->row;
+	double v_row_y = double(dy_row) / p->row;
 
-	buf[0] = uint8_t(((record_len + 4) >> 8) & 0xFF);
-	buf[1] = uint8_t((record_len + 4) & 0xFF);
-	buf[2] = uint8_t((record >> 8) & 0xFF);
-	buf[3] = uint8_t(record & 0xFF);
+	Pair out = { (int)(p->x1 + col * v_col_x + row * v_row_x), (int)(p->y1 + col * v_col_y + row * v_row_y) };
 
-	fwrite(buf, 4, 1, file);
-	fwrite(string, text_len, 1, file);
-	if (text_len % 2) putc(0, file);
+	return out;
 }
 
+static Scratch& ThreadScratch()
+{
+	static thread_local Scratch scratch;
+
+	return scratch;
+}
 
-static void TransformPoly(Pair* pout, Pair* pin, size_t size, Transform tra)
+template <typename T>
+static T* GrowBuffer(std::vector<T>& buf, size_t size)
 {
-	unsigned int i;
-	double sign = 1.0;
-	double angle_rad = M_PI * tra.angle / 180.0;
+	// At least size elements; the buffer never shrinks
+	if (buf.size() < size)
+		buf.resize(size);
+
+	return buf.data();
+}
 
-	// Reflect with respect to x axis first before rotation
-	if (tra.mirror)
-		sign = -1.0;
+// Functions to handle bounding boxes. A box is stored as its (min, max)
+// corners; an empty box has min > max.
 
-	for (i = 0; i < size; i++) {
-		pout[i].x = (int)(tra.x + tra.mag * (pin[i].x * cos(angle_rad) - sign * pin[i].y * sin(angle_rad)));
-		pout[i].y = (int)(tra.y + tra.mag * (pin[i].x * sin(angle_rad) +
-			sign * pin[i].y * cos(angle_rad)));
-	}
+static void AddToBox(Pair* box, const Pair* p, size_t size)
+{
+	BoundPairs(box, p, size);
 }
 
-// Functions to add a polygon to a file and polygon set
+static void TransformBox(Pair* out, const Pair* box, Transform tra)
+{
+	// Box around the transformed box; grown by a unit for the truncation
+	// of the transformed coordinates.
+
+	Pair corners[4] = { box[0], { box[1].x, box[0].y }, box[1], { box[0].x, box[1].y } };
+	Pair tmp[4];
+
+	TransformPoly(tmp, corners, 4, tra);
 
-static void BufWriteInt(uint8_t* p, size_t offset, int32_t n) {
-	p[offset + 0] = uint8_t((n >> 24) & 0xFF);
-	p[offset + 1] = uint8_t((n >> 16) & 0xFF);
-	p[offset + 2] = uint8_t((n >> 8) & 0xFF);
-	p[offset + 3] = uint8_t(n & 0xFF);
+	out[0] = { INT_MAX, INT_MAX };
+	out[1] = { INT_MIN, INT_MIN };
+	AddToBox(out, tmp, 4);
+
+	out[0].x -= 1;
+	out[0].y -= 1;
+	out[1].x += 1;
+	out[1].y += 1;
 }
 
-static void FileAppendPoly(FILE* pfile, Pair* p, size_t size, uint16_t layer)
+static bool TestBoxOverlap(const Pair* box, Transform tra, const Pair* bbox)
 {
-	// Store polygon in buffer in the format of the gds standard.
+	// Test if a cell bounding box, transformed by tra, overlaps bbox
 
-	FileAppendRecord(pfile, GDS_BOUNDARY);
-	FileAppendShort(pfile, GDS_LAYER, layer);
-	FileAppendShort(pfile, GDS_DATATYPE, 0);
+	Pair tbox[2];
 
-	uint8_t* buf = new uint8_t[8 * size];
-	for (unsigned int i = 0; i < size; i++) {
-		BufWriteInt(buf, 8 * i, p[i].x);
-		BufWriteInt(buf, 8 * i + 4, p[i].y);
-	}
+	if (box[0].x > box[1].x)
+		return false;
 
-	FileAppendBytes(pfile, GDS_XY, buf, 8 * size);
-	FileAppendRecord(pfile, GDS_ENDEL);
+	TransformBox(tbox, box, tra);
 
-	delete[] buf;
+	return (tbox[0].y <= bbox[2].y && tbox[1].y >= bbox[0].y && tbox[0].x <= bbox[2].x &&
+		tbox[1].x >= bbox[0].x);
 }
 
-static bool TestPolyOverlap(Pair* p, size_t size, Pair* bbox)
+static bool TestPolyOverlap(const Pair* p, size_t size, const Pair* bbox)
 {
-	unsigned int i;
-	int minx = INT_MAX, miny = INT_MAX, maxx = INT_MIN, maxy = INT_MIN;
+	Pair box[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
 
 	if (!bbox)
 		return true;
 
 	/* the final (closing) point is not needed for this evaluation */
-	for (i = 0; i < size - 1; i++) {
-		if (p[i].x > maxx)  maxx = p[i].x;
-		if (p[i].y > maxy)  maxy = p[i].y;
-		if (p[i].x < minx)  minx = p[i].x;
-		if (p[i].y < miny)  miny = p[i].y;
+	AddToBox(box, p, size - 1);
+
+	return (box[0].y <= bbox[2].y && box[1].y >= bbox[0].y && box[0].x <= bbox[2].x &&
+		box[1].x >= bbox[0].x);
+}
+
+static bool ClipInside(Pair p, int side, int32_t c)
+{
+	switch (side) {
+	case 0:
+		return p.x >= c;
+	case 1:
+		return p.y >= c;
+	case 2:
+		return p.x <= c;
+	default:
+		return p.y <= c;
+	}
+}
+
+static Pair ClipCross(Pair a, Pair b, int side, int32_t c, bool manhattan)
+{
+	// Where edge a-b crosses the window side at c. A Manhattan edge crossing
+	// a side is perpendicular to it, so the crossing is on the grid.
+
+	bool vertical = (side & 1) == 0; // Side x = c
+
+	if (manhattan)
+		return vertical ? Pair{ c, a.y } : Pair{ a.x, c };
+
+	if (vertical)
+		return { c, int32_t(llround(a.y + (double(c) - a.x) * (double(b.y) - a.y) / (double(b.x) - a.x))) };
+
+	return { int32_t(llround(a.x + (double(c) - a.y) * (double(b.x) - a.x) / (double(b.y) - a.y))), c };
+}
+
+static size_t ClipSide(const Pair* in, size_t n, Pair* out, int side, int32_t c, bool manhattan)
+{
+	// One Sutherland-Hodgman step: the part of the (unclosed) polygon in on
+	// the inside of a window side, unclosed, without repeated vertices
+
+	size_t m = 0;
+
+	auto add = [&](Pair p) {
+		if (m == 0 || p.x != out[m - 1].x || p.y != out[m - 1].y)
+			out[m++] = p;
+	};
+
+	for (size_t i = 0; i < n; i++) {
+		Pair a = in[i == 0 ? n - 1 : i - 1], b = in[i];
+		bool ina = ClipInside(a, side, c), inb = ClipInside(b, side, c);
+
+		if (ina != inb)
+			add(ClipCross(a, b, side, c, manhattan));
+		if (inb)
+			add(b);
+	}
+
+	if (m > 1 && out[m - 1].x == out[0].x && out[m - 1].y == out[0].y)
+		m--;
+
+	return m;
+}
+
+static Pair* ClipPoly(Pair* p, size_t& size, const Pair* bbox)
+{
+	// Cut a closed polygon to the window bbox. Return the polygon, closed,
+	// in a scratch buffer, p itself if it is inside the window or nullptr if
+	// nothing with an area is left. Where a concave polygon leaves the
+	// window and comes back, the parts are joined by a zero width bridge
+	// along the window edge.
+
+	Pair box[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
+	size_t n = size - 1;
+
+	AddToBox(box, p, n);
+
+	if (box[0].x >= bbox[0].x && box[0].y >= bbox[0].y && box[1].x <= bbox[2].x && box[1].y <= bbox[2].y)
+		return p;
+
+	bool manhattan = true;
+
+	for (size_t i = 0; i < n && manhattan; i++)
+		manhattan = p[i].x == p[i + 1].x || p[i].y == p[i + 1].y;
+
+	Scratch& scratch = ThreadScratch();
+	const Pair* in = p;
+	Pair* out = nullptr;
+	int32_t sides[4] = { bbox[0].x, bbox[0].y, bbox[2].x, bbox[2].y };
+
+	for (int side = 0; side < 4 && n >= 3; side++) {
+		// Every input edge gives at most two output vertices
+		out = GrowBuffer(scratch.clip[side & 1], 2 * n + 1);
+		n = ClipSide(in, n, out, side, sides[side], manhattan);
+		in = out;
+	}
+
+	if (n < 3)
+		return nullptr;
+
+	double area = 0.0;
+
+	for (size_t i = 0; i < n; i++) {
+		const Pair& a = out[i];
+		const Pair& b = out[(i + 1) % n];
+
+		area += double(a.x) * b.y - double(b.x) * a.y;
 	}
 
-	return (miny <= bbox[2].y && maxy >= bbox[0].y && minx <= bbox[2].x &&
-		maxx >= bbox[0].x);
+	if (area == 0.0)
+		return nullptr;
+
+	out[n] = out[0];
+	size = n + 1;
+
+	return out;
+}
+
+static void AddDensity(Pair* pairs, size_t size, uint16_t layer, DensityPart& part);
+
+static void EmitPoly(Pair* pairs, size_t size, uint16_t layer, uint16_t datatype, Recdata& data)
+{
+	// Add polygon to file, polygon set, sink, task buffer or density tiles
+	if (data.pwriter) {
+		data.pwriter->AppendPoly(pairs, size, layer);
+	}
+	if (data.pset) {
+		Polygon p(pairs, size, layer);
+		data.pset->push_back(p);
+	}
+	if (data.pbuf) {
+		data.pbuf->pairs.insert(data.pbuf->pairs.end(), pairs, pairs + size);
+		data.pbuf->sizes.push_back(uint32_t(size));
+		data.pbuf->layers.push_back(layer);
+		data.pbuf->datatypes.push_back(datatype);
+	}
+	if (data.psink) {
+		data.psink->Add(pairs, size, layer, datatype);
+	}
+	if (data.density) {
+		AddDensity(pairs, size, layer, *data.density);
+	}
+	data.pcount++;
 }
 
-static void AddPoly(Pair* pairs, size_t size, uint16_t layer, Recdata& data)
+static void AddPoly(Pair* pairs, size_t size, uint16_t layer, uint16_t datatype, Recdata& data)
 {
 	data.scount++;
 
-	// Add polygon to file or polygon set
-	if (!data.usebbox || TestPolyOverlap(pairs, size, data.bbox)) {
-		if (data.poutfile) {
-			FileAppendPoly(data.poutfile, pairs, size, layer);
-		}
-		if (data.pset) {
-			Polygon p(pairs, size, layer);
-			data.pset->push_back(p);
-		}
-		data.pcount++;
+	if (!data.usebbox) {
+		EmitPoly(pairs, size, layer, datatype, data);
 	}
+	else if (TestPolyOverlap(pairs, size, data.bbox)) {
+		if (data.clip)
+			pairs = ClipPoly(pairs, size, data.bbox);
 
-	if (data.pcount >= data.max_polys)
-		return;
+		if (pairs)
+			EmitPoly(pairs, size, layer, datatype, data);
+	}
 }
 
 // Functions to expand a GDS PATH element
@@ -296,7 +742,7 @@ static Pair ProjectLine(Pair p, Line* line)
 	return IntersectLines(line, &normal);
 }
 
-static void ExpandPath(Pair* pout, Pair* pin, size_t size, uint32_t width, int pathtype)
+static void ExpandPath(Pair* pout, const Pair* pin, size_t size, uint32_t width, int pathtype)
 {
 	size_t i;
 	double hwidth = width / 2.0;
@@ -306,10 +752,10 @@ static void ExpandPath(Pair* pout, Pair* pin, size_t size, uint32_t width, int p
 	if (size < 2) return;
 
 	// parallel line segments on both sides
-	mline = new Line[size - 1];
-	pline = new Line[size - 1];
+	Scratch& scratch = ThreadScratch();
 
-	if (!mline || !pline) return;
+	mline = GrowBuffer(scratch.mline, size - 1);
+	pline = GrowBuffer(scratch.pline, size - 1);
 
 	for (i = 0; i < size - 1; i++) {
 		double a, b, c, c_trans;
@@ -357,568 +803,2664 @@ static void ExpandPath(Pair* pout, Pair* pin, size_t size, uint32_t width, int p
 	}
 	pout[size - 1] = ProjectLine(end_point, &pline[size - 2]);
 	pout[size] = ProjectLine(end_point, &mline[size - 2]);
-
-	delete[] pline;
-	delete[] mline;
 }
 
 // Functions to recurse through the hierarchy of the cell
 
 static Cell* FindCell(Database* gds, const wchar_t* name)
 {
-	for (auto it = std::begin(gds->m_cells); it != std::end(gds->m_cells); ++it) {
-		if (wcscmp(it->wstrname, name) == 0)
-			return &*it;
-	}
+	auto it = gds->m_nameIndex.find(name);
 
-	return nullptr;
+	if (it == gds->m_nameIndex.end() || gds->m_cellIndex[it->second] == GDS_NO_CELL)
+		return nullptr;
+
+	return &gds->m_cells[gds->m_cellIndex[it->second]];
 }
 
-static bool Recurse(Cell& top, Transform tra, Recdata& data)
+static bool Recurse(Cell& top, const Transform& tra, Recdata& data);
+
+static Pair* ElementPoly(const Cell& top, size_t element, const Transform& tra, const LayerFilter* filter, size_t& size, uint16_t& layer, uint16_t& datatype)
 {
-	// Return false if the recursion needs to stop because of an error or the
-	// max allowed output polygons is reached.
+	// The transformed polygon of a BOUNDARY or PATH element (boundaries
+	// first) in the scratch buffer of the thread, or nullptr if it is empty
+	// or not selected by filter
 
-	Pair out[400];
-	Pair tmp[400];
+	Scratch& scratch = ThreadScratch();
+	size_t bcount = top.boundaries.size();
 
-	// BOUNDARY elements
-	for (auto it = std::begin(top.boundaries); it != std::end(top.boundaries); ++it)
-	{
-		TransformPoly(out, &it->pairs.at(0), it->pairs.size(), tra);
+	if (element < bcount) {
+		// BOUNDARY element
+		const Bndry& it = top.boundaries[element];
 
-		AddPoly(out, it->pairs.size(), it->layer, data);
+		if (it.count == 0 || (filter && !filter->Selected(it.layer, it.datatype)))
+			return nullptr;
 
-		if (data.pcount >= data.max_polys)
-			return false;
+		Pair* out = GrowBuffer(scratch.out, it.count);
+
+		TransformPoly(out, &top.pairs[it.offset], it.count, tra);
+
+		size = it.count;
+		layer = it.layer;
+		datatype = it.datatype;
+		return out;
 	}
 
-	// PATH elements
-	for (auto it = std::begin(top.paths); it != std::end(top.paths); ++it)
-	{
-		// The size of the expanded polygon
-		size_t out_size = 2 * it->pairs.size() + 1U;
+	// PATH element
+	const Path& it = top.paths[element - bcount];
 
-		// Expand and transform
-		ExpandPath(tmp, &it->pairs.at(0), it->pairs.size(), it->width, it->pathtype);
-		TransformPoly(out, tmp, out_size, tra);
+	if (it.count == 0 || (filter && !filter->Selected(it.layer, it.datatype)))
+		return nullptr;
 
-		AddPoly(out, out_size, it->layer, data);
+	// The size of the expanded polygon
+	size_t out_size = 2 * size_t(it.count) + 1U;
+	Pair* tmp = GrowBuffer(scratch.path, out_size);
+	Pair* out = GrowBuffer(scratch.out, out_size);
 
-		if (data.pcount >= data.max_polys)
-			return false;
-	}
+	// Expand and transform
+	ExpandPath(tmp, &top.pairs[it.offset], it.count, it.width, it.pathtype);
+	TransformPoly(out, tmp, out_size, tra);
 
-	// SREF elements
-	for (auto it = std::begin(top.srefs); it != std::end(top.srefs); ++it)
-	{
-		Cell* str;
-		Transform acc_tra;
+	size = out_size;
+	layer = it.layer;
+	datatype = it.datatype;
+	return out;
+}
 
-		str = FindCell(data.gds, it->sname);
+static bool AddElements(Frame& frame, Recdata& data)
+{
+	// Add the BOUNDARY and PATH elements of a cell from frame.element on.
+	// Return false if the max allowed output polygons is reached.
 
-		// This should not happen in a correct GDS file
-		if (!str) {
-			throw std::runtime_error("SREF cell not found");
-		}
+	Cell& top = *frame.cell;
+	const LayerFilter* filter = data.gds->m_filter.get();
+	size_t count = top.boundaries.size() + top.paths.size();
 
-		// Accumulate the transformations
+	while (frame.element < count) {
+		size_t size;
+		uint16_t layer, datatype;
+		Pair* out = ElementPoly(top, frame.element++, frame.tra, filter, size, layer, datatype);
 
-		acc_tra.x = tra.x + it->x;
-		acc_tra.y = tra.y + it->y;
-		acc_tra.mag = tra.mag * it->mag;
-		acc_tra.angle = tra.angle + it->angle;
-		acc_tra.mirror = static_cast<uint16_t> (tra.mirror ^ (it->strans & 0x8000));
+		if (!out)
+			continue;
 
+		AddPoly(out, size, layer, datatype, data);
 
-		// Down a level
-		if (!Recurse(*str, acc_tra, data))
+		if (data.pcount >= data.max_polys)
 			return false;
 	}
 
-	// Expand AREF elements
-	for (auto it = std::begin(top.arefs); it != std::end(top.arefs); ++it)
-	{
-		Cell* str;
-		Aref* p = &*it;
-
-		// Find the structure name being referenced
-		str = FindCell(data.gds, it->sname);
+	return true;
+}
 
-		if (!str) {
-			throw std::runtime_error("AREF cell not found");
-			return false;
-		}
+static bool RecurseElements(Cell& top, const Transform& tra, Recdata& data)
+{
+	// Add only the BOUNDARY and PATH elements of a cell
 
-		// (v_col_x, v_col_y) vector in column direction
-		double v_col_x = (double(p->x2) - p->x1) / p->col;
-		double v_col_y = (double(p->y2) - p->y1) / p->col;
+	Frame frame;
 
-		// (v_row_x, v_row_y) vector in row direction
-		double v_row_x = (double(p->x3) - p->x1) / p->row;
-		double v_row_y = (double(p->y3) - p->y1) / p->row;
+	frame.cell = &top;
+	frame.tra = tra;
 
-		// loop through the reference points of the array
-		for (int col = 0; col < p->col; col++) {
-			for (int row = 0; row < p->row; row++) {
+	return AddElements(frame, data);
+}
 
-				int x_ref, y_ref, x_ref_t, y_ref_t;
-				double angle_radians, sign;
-				Transform acc_tra;
+// Functions to reuse the flattened polygons of a cell from the cache
 
-				// Origin of the cell being referenced in the reference
-				// frame of the aref
-				x_ref = (int)(p->x1 + col * v_col_x + row * v_row_x);
-				y_ref = (int)(p->y1 + col * v_col_y + row * v_row_y);
+static double SumHierarchy(Database* gds, uint32_t root, std::vector<double>& memo, double (*own)(const Cell&))
+{
+	// Sum of own() over all the cells of the flattened root, memoized in memo
+	// (< 0 if not known yet). The hierarchy is walked with an explicit stack;
+	// a reference back to a cell still being summed counts as 0.
 
+	if (memo[root] >= 0.0)
+		return memo[root];
 
-				// Origin of the cell being referenced in the reference
-				// frame of the top cell (so after transformations)
-				angle_radians = M_PI * tra.angle / 180.0;
-				sign = 1.0;
-				if (tra.mirror) {
-					sign = -1;
-				}
-				x_ref_t = tra.x + (int)(tra.mag * (x_ref * cos(angle_radians) - sign * y_ref * sin(angle_radians)));
-				y_ref_t = tra.y + (int)(tra.mag * (x_ref * sin(angle_radians) + sign * y_ref * cos(angle_radians)));
+	// Cells with a flag telling if their children are pushed already
+	std::vector<std::pair<uint32_t, bool>> stack = { { root, false } };
 
-				// Cell referenced still needs to be transformed
+	while (!stack.empty()) {
+		uint32_t cell = stack.back().first;
+		Cell& str = gds->m_cells[cell];
 
-				acc_tra.x = x_ref_t,
-					acc_tra.y = y_ref_t;
-				acc_tra.mag = tra.mag * p->mag;
-				acc_tra.angle = tra.angle + p->angle;
-				acc_tra.mirror = static_cast<uint16_t> (tra.mirror ^ (p->strans & 0x8000));
+		if (!stack.back().second) {
+			// Done meanwhile through another parent
+			if (memo[cell] >= 0.0) {
+				stack.pop_back();
+				continue;
+			}
 
+			// Guards against recursive references
+			memo[cell] = 0.0;
+			stack.back().second = true;
 
-				// Down a level
-				if (!Recurse(*str, acc_tra, data))
-					return false;
+			for (auto it = std::begin(str.children); it != std::end(str.children); ++it) {
+				if (memo[*it] < 0.0)
+					stack.push_back({ *it, false });
 			}
+			continue;
+		}
+
+		double n = own(str);
+
+		for (auto it = std::begin(str.srefs); it != std::end(str.srefs); ++it) {
+			if (it->cell != GDS_NO_CELL)
+				n += memo[it->cell];
+		}
+		for (auto it = std::begin(str.arefs); it != std::end(str.arefs); ++it) {
+			if (it->cell != GDS_NO_CELL)
+				n += double(it->col) * it->row * memo[it->cell];
 		}
+
+		memo[cell] = n;
+		stack.pop_back();
 	}
 
-	return true;
+	return memo[root];
 }
 
-// Member functions
-
-Database::Database(const wchar_t* file)
+static double OwnPolys(const Cell& cell)
 {
-	FILE* p_file;
+	return double(cell.boundaries.size() + cell.paths.size());
+}
 
-	m_filePath = std::wstring(file);
+static double OwnBytes(const Cell& cell)
+{
+	double n = 0.0;
 
-	enum STR_TYPE
-	{
-		NONE,
-		BRY,
-		PATH,
-		SREF,
-		AREF
-	} curElem = NONE;
-
-	// Current GDS structure being read
-	Cell curCell = {};
-
-	// The different elements
-	Bndry curBndry = {};
-	Path curPath = {};
-	SRef curSRef = {};
-	Aref curARef = {};
-
-	p_file = nullptr;
-	_wfopen_s(&p_file, file, L"rb");
+	for (auto it = std::begin(cell.boundaries); it != std::end(cell.boundaries); ++it)
+		n += 8.0 * it->count + 8.0;
+	for (auto it = std::begin(cell.paths); it != std::end(cell.paths); ++it)
+		n += 8.0 * (2.0 * it->count + 1.0) + 8.0;
 
-	if (!p_file)
-	{
-		throw std::runtime_error("Could not find or open GDS file");
-	}
+	return n;
+}
 
-	// Number of bytes and cells read
-	uint64_t bytes_read = 0;
-	uint64_t cell_count = 0;
-	bool readEndlib = false;
+static double OwnInexact(const Cell& cell)
+{
+	double n = 0.0;
 
-	while (true)
-	{
-		uint8_t rheader[4], * buf;
-		uint16_t buf_size, record_len, record_type;
+	for (auto it = std::begin(cell.srefs); it != std::end(cell.srefs); ++it)
+		n += AccumulateTransform(Transform(), it->x, it->y, it->strans, it->mag, it->angle).kind == Transform::AFFINE;
+	for (auto it = std::begin(cell.arefs); it != std::end(cell.arefs); ++it)
+		n += AccumulateTransform(Transform(), 0, 0, it->strans, it->mag, it->angle).kind == Transform::AFFINE;
 
-		fread(rheader, 1, 4, p_file);
-		bytes_read += 4;
+	return n;
+}
 
-		// First 2 bytes: record length; second 2 bytes record type and data type
-		record_len = uint16_t((rheader[0] << 8) | rheader[1]);
-		record_type = uint16_t(rheader[2] << 8 | rheader[3]);
+static double CountPolys(Database* gds, uint32_t cell, std::vector<double>& counts)
+{
+	// Number of polygons of the flattened cell, memoized in counts (< 0 if
+	// not known yet)
 
-		// Minimum record length is 4
-		if (record_len < 4) {
-			throw std::runtime_error("Invalid GDS record (size < 4) found");
-		}
+	return SumHierarchy(gds, cell, counts, OwnPolys);
+}
 
-		// The size of the additional data in bytes
-		buf_size = record_len - 4U;
+static double EstimateBytes(Database* gds, uint32_t cell, std::vector<double>& bytes)
+{
+	// Size of the flattened cell in a PolyBuffer, memoized in bytes (< 0 if
+	// not known yet)
 
-		buf = new uint8_t[buf_size];
+	return SumHierarchy(gds, cell, bytes, OwnBytes);
+}
 
-		if (!buf) {
-			throw std::runtime_error("Error reading data record");
-		}
-		bytes_read += fread(buf, 1, buf_size, p_file);
+static double CountInexact(Database* gds, uint32_t cell, std::vector<double>& counts)
+{
+	// Number of inexact references in the flattened cell, memoized in counts
+	// (< 0 if not known yet)
 
-		// Handle the GDS records
-		switch (record_type) {
-		case GDS_HEADER:
-			if (bytes_read != 6)
-			{
-				// GDH_HEADER should be the first record of a GDS file
-				throw std::runtime_error("GDS file should start with HEADER record");
-			}
-			if (buf && buf_size == 2)
-			{
-				m_version = uint16_t(buf[0] << 8 | buf[1]);
-				if (m_version != 600 && m_version != 6)
-				{
-					throw std::runtime_error("Unsupported GDS version");
-				}
-			}
-			break;
-		case GDS_BGNLIB:
-			break;
-		case GDS_ENDLIB:
-			readEndlib = true;
-			break;
-		case GDS_LIBNAME:
-			{
-				// add to libnames after converting to wide
+	return SumHierarchy(gds, cell, counts, OwnInexact);
+}
 
-				std::string s((char*)buf, buf_size);
+static size_t BufferBytes(const PolyBuffer& buf)
+{
+	return buf.pairs.size() * sizeof(Pair) + buf.sizes.size() * (sizeof(uint32_t) + 2 * sizeof(uint16_t));
+}
 
-				std::wstring ws = to_wstring(s);
+static std::shared_ptr<const PolyBuffer> CachedCell(uint32_t cell, Recdata& data)
+{
+	// The flattened polygons of cell in its own coordinates, taken from the
+	// cache or flattened and added to it now. Null if the cell is too large
+	// for the cache.
 
+	FlattenCache* cache = data.cache;
 
+	if (cache->estimates[cell] > cache->max_bytes / 8)
+		return nullptr;
 
-				m_libnames.push_back(ws);
-			}
-			break;
-		case GDS_BGNSTR:
-			cell_count++;
-			break;
-		case GDS_ENDSTR:
-			m_cells.push_back(curCell);
-			curCell = {};
-			break;
-		case GDS_UNITS:
-			{
-				m_uu_per_dbunit = BufReadFloat(buf);
-				m_meter_per_dbunit = BufReadFloat(buf + 8);
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
 
-				if (buf_size == 16)
-					memcpy(m_units, buf, 16); // also store the buffer raw data
+		auto it = cache->cells.find(cell);
+		if (it != cache->cells.end()) {
+			// Mark as most recently used
+			cache->lru.splice(cache->lru.begin(), cache->lru, it->second.second);
+			return it->second.first;
+		}
 
-				break;
-			}
-		case GDS_STRNAME:
-			{
-				std::string s((char*)buf, buf_size);
+		// Only cells instanced more than once are worth caching
+		if (!cache->seen[cell]) {
+			cache->seen[cell] = 1;
+			return nullptr;
+		}
+	}
 
+	// Flatten without window or limit; the referenced cells come from the
+	// cache as well, up to a nesting depth that keeps the stack bounded
+	static thread_local unsigned depth = 0;
 
+	std::shared_ptr<PolyBuffer> buf = std::make_shared<PolyBuffer>();
+	Recdata local{};
 
-				std::wstring ws = to_wstring(s);
+	local.gds = data.gds;
+	local.max_polys = UINT64_MAX;
+	local.pbuf = buf.get();
+	local.cache = depth < 32 ? cache : nullptr;
 
-				wcscpy_s(curCell.wstrname, GDS_MAX_STR_NAME, ws.c_str());
+	depth++;
+	try {
+		Recurse(data.gds->m_cells[cell], Transform(), local);
+	}
+	catch (...) {
+		depth--;
+		throw;
+	}
+	depth--;
 
-				break;
+	std::lock_guard<std::mutex> guard(cache->lock);
+
+	// Another thread may have added the cell meanwhile
+	if (cache->cells.find(cell) == cache->cells.end()) {
+		cache->lru.push_front(cell);
+		cache->cells[cell] = { buf, cache->lru.begin() };
+		cache->bytes += BufferBytes(*buf);
+
+		// Evict the least recently used cells; blocks still in use by other
+		// threads are released when they are done with them
+		while (cache->bytes > cache->max_bytes && cache->lru.size() > 1) {
+			auto last = cache->cells.find(cache->lru.back());
+
+			cache->bytes -= BufferBytes(*last->second.first);
+			cache->cells.erase(last);
+			cache->lru.pop_back();
+		}
+	}
+
+	return buf;
+}
+
+static bool AddCachedPolys(Frame& frame, Recdata& data)
+{
+	// Transform and add the cached polygons of a cell from frame.element on.
+	// Return false if the max allowed output polygons is reached.
+
+	const PolyBuffer& buf = *frame.cached;
+	Scratch& scratch = ThreadScratch();
+
+	while (frame.element < buf.sizes.size()) {
+		size_t i = frame.element++;
+		Pair* out = GrowBuffer(scratch.out, buf.sizes[i]);
+
+		TransformPoly(out, &buf.pairs[frame.offset], buf.sizes[i], frame.tra);
+		frame.offset += buf.sizes[i];
+
+		AddPoly(out, buf.sizes[i], buf.layers[i], buf.datatypes[i], data);
+
+		if (data.pcount >= data.max_polys)
+			return false;
+	}
+
+	return true;
+}
+
+static bool TestBoxInside(const Pair* box, Transform tra, const Pair* bbox)
+{
+	// Test if a cell bounding box, transformed by tra, is inside bbox
+
+	Pair tbox[2];
+
+	TransformBox(tbox, box, tra);
+
+	return (tbox[0].x >= bbox[0].x && tbox[0].y >= bbox[0].y && tbox[1].x <= bbox[2].x &&
+		tbox[1].y <= bbox[2].y);
+}
+
+static void PushRef(std::vector<Frame>& stack, uint32_t cell, const Transform& tra, Recdata& data)
+{
+	// Down a level, through the cache if enabled. The cache is skipped for
+	// cells crossing the window, which are culled per reference instead, for
+	// cells with more polygons than are still allowed and where transforming
+	// the cached polygons could round differently from a direct flatten.
+
+	Frame frame;
+
+	frame.cell = &data.gds->m_cells[cell];
+	frame.tra = tra;
+
+	bool use_cache = data.cache && data.cache->polys[cell] <= double(data.max_polys - data.pcount) &&
+		tra.kind != Transform::AFFINE && data.cache->inexact[cell] == 0.0;
+
+	if (use_cache && data.usebbox)
+		use_cache = TestBoxInside(frame.cell->bbox, tra, data.bbox);
+
+	if (use_cache)
+		frame.cached = CachedCell(cell, data);
+
+	// Deeper than the number of cells means a cell references itself
+	if (stack.size() > data.gds->m_cells.size())
+		throw std::runtime_error("Recursive cell reference");
+
+	stack.push_back(std::move(frame));
+}
+
+static bool Resume(std::vector<Frame>& stack, Recdata& data)
+{
+	// Flatten the cells on the stack depth first. Return true when the stack
+	// is empty, or false if the max allowed output polygons is reached; the
+	// stack then holds where to go on.
+
+	while (!stack.empty()) {
+		Frame& frame = stack.back();
+		Cell& top = *frame.cell;
+
+		if (frame.cached) {
+			if (!AddCachedPolys(frame, data))
+				return false;
+
+			stack.pop_back();
+			continue;
+		}
+
+		if (!AddElements(frame, data))
+			return false;
+
+		// SREF elements
+		if (frame.sref < top.srefs.size()) {
+			const SRef& it = top.srefs[frame.sref++];
+
+			// This should not happen in a correct GDS file
+			if (it.cell == GDS_NO_CELL) {
+				throw std::runtime_error("SREF cell not found");
 			}
-		case GDS_BOUNDARY:
-			curElem = BRY;
-			break;
-		case GDS_PATH:
-			curElem = PATH;
-			break;
-		case GDS_SREF:
-			curElem = SREF;
-			break;
-		case GDS_AREF:
-			curElem = AREF;
-			break;
-		case GDS_TEXT:
-			break;
-		case GDS_NODE:
-			break;
-		case GDS_BOX:
-			break;
-		case GDS_ENDEL:
-			// add element to the current structure
-
-			switch (curElem) {
-			case BRY:
-				curCell.boundaries.push_back(curBndry);
-				curBndry = {};
-				curElem = NONE;
-				break;
-			case PATH:
-				curCell.paths.push_back(curPath);
-				curPath = {};
-				curElem = NONE;
-				break;
-			case SREF:
-				curCell.srefs.push_back(curSRef);
-				curSRef = {};
-				curElem = NONE;
-				break;
-			case AREF:
-				curCell.arefs.push_back(curARef);
-				curARef = {};
-				curElem = NONE;
-				break;
-			case NONE:
-				break;
+
+			// Skip cells without selected layers
+			if (!data.gds->m_cellSelected[it.cell])
+				continue;
+
+			// Accumulate the transformations
+			Transform acc_tra = AccumulateTransform(frame.tra, it.x, it.y, it.strans, it.mag, it.angle);
+
+			// Skip the reference if it falls outside the bounding box
+			if (data.usebbox && !TestBoxOverlap(data.gds->m_cells[it.cell].bbox, acc_tra, data.bbox))
+				continue;
+
+			// Down a level; frame is not valid after this
+			PushRef(stack, it.cell, acc_tra, data);
+			continue;
+		}
+
+		// Expand AREF elements
+		if (frame.aref < top.arefs.size()) {
+			const Aref& it = top.arefs[frame.aref];
+
+			if (it.cell == GDS_NO_CELL) {
+				throw std::runtime_error("AREF cell not found");
 			}
-			break;
-		case GDS_SNAME: // SREF, AREF
-			switch (curElem) {
-			case SREF:
-				{
-					std::string s((char*)buf, buf_size);
-					std::wstring ws = to_wstring(s);
-					wcscpy_s(curSRef.sname, GDS_MAX_STR_NAME, ws.c_str());;
-				}
-				break;
-			case AREF:
-				{
-					std::string s((char*)buf, buf_size);
-					std::wstring ws = to_wstring(s);
-					wcscpy_s(curARef.sname, GDS_MAX_STR_NAME, ws.c_str());;
-				}
-				break;
-			case BRY:
-			case PATH:
-				throw std::runtime_error("Invalid SNAME record");
-			case NONE:
-				break;
+
+			// None for a cell without selected layers
+			size_t refs = it.col > 0 && it.row > 0 && data.gds->m_cellSelected[it.cell] ? size_t(it.col) * size_t(it.row) : 0;
+
+			if (frame.ref >= refs) {
+				frame.aref++;
+				frame.ref = 0;
+				continue;
 			}
-			break;
-		case GDS_COLROW: // AREF
-			if (curElem == AREF) {
-				curARef.col = uint16_t(buf[0] << 8 | buf[1]);
-				curARef.row = uint16_t(buf[2] << 8 | buf[3]);
+
+			// The transformations of the references only differ in their origin
+			if (frame.ref == 0)
+				frame.aref_tra = AccumulateTransform(frame.tra, it.x1, it.y1, it.strans, it.mag, it.angle);
+
+			int col = int(frame.ref / it.row), row = int(frame.ref % it.row);
+			frame.ref++;
+
+			Pair ref = ArefOrigin(&it, col, row);
+			Pair origin = TransformOffset(frame.tra, ref.x, ref.y);
+			Transform acc_tra = frame.aref_tra;
+
+			acc_tra.x = origin.x;
+			acc_tra.y = origin.y;
+
+			// Skip the reference if it falls outside the bounding box
+			if (data.usebbox && !TestBoxOverlap(data.gds->m_cells[it.cell].bbox, acc_tra, data.bbox))
+				continue;
+
+			// Down a level; frame is not valid after this
+			PushRef(stack, it.cell, acc_tra, data);
+			continue;
+		}
+
+		stack.pop_back();
+	}
+
+	return true;
+}
+
+static bool RecurseRef(uint32_t cell, const Transform& tra, Recdata& data)
+{
+	// Flatten a referenced cell. Return false if the max allowed output
+	// polygons is reached.
+
+	std::vector<Frame> stack;
+
+	PushRef(stack, cell, tra, data);
+
+	return Resume(stack, data);
+}
+
+static bool Recurse(Cell& top, const Transform& tra, Recdata& data)
+{
+	// Flatten a cell. Return false if the max allowed output polygons is
+	// reached.
+
+	std::vector<Frame> stack(1);
+
+	stack[0].cell = &top;
+	stack[0].tra = tra;
+
+	return Resume(stack, data);
+}
+
+// Functions to flatten a cell on multiple threads
+
+static void SplitTask(const FlattenTask& task, Recdata& data, std::vector<double>& counts, std::vector<FlattenTask>& out)
+{
+	// Split a subtree task in a task for the elements of its cell followed by
+	// a subtree task per (AREF) reference, in the order Recurse visits them.
+
+	Cell& top = *task.cell;
+	Database* gds = data.gds;
+
+	out.push_back({ task.cell, task.tra, true, double(top.boundaries.size() + top.paths.size()) });
+
+	for (auto it = std::begin(top.srefs); it != std::end(top.srefs); ++it)
+	{
+		if (it->cell == GDS_NO_CELL) {
+			throw std::runtime_error("SREF cell not found");
+		}
+
+		if (!gds->m_cellSelected[it->cell])
+			continue;
+
+		Transform acc_tra = AccumulateTransform(task.tra, it->x, it->y, it->strans, it->mag, it->angle);
+
+		if (data.usebbox && !TestBoxOverlap(gds->m_cells[it->cell].bbox, acc_tra, data.bbox))
+			continue;
+
+		out.push_back({ &gds->m_cells[it->cell], acc_tra, false, CountPolys(gds, it->cell, counts) });
+	}
+
+	for (auto it = std::begin(top.arefs); it != std::end(top.arefs); ++it)
+	{
+		if (it->cell == GDS_NO_CELL) {
+			throw std::runtime_error("AREF cell not found");
+		}
+
+		if (!gds->m_cellSelected[it->cell])
+			continue;
+
+		for (int col = 0; col < it->col; col++) {
+			for (int row = 0; row < it->row; row++) {
+				Pair ref = ArefOrigin(&*it, col, row);
+				Transform acc_tra = AccumulateTransform(task.tra, ref.x, ref.y, it->strans, it->mag, it->angle);
+
+				if (data.usebbox && !TestBoxOverlap(gds->m_cells[it->cell].bbox, acc_tra, data.bbox))
+					continue;
+
+				out.push_back({ &gds->m_cells[it->cell], acc_tra, false, CountPolys(gds, it->cell, counts) });
 			}
+		}
+	}
+}
+
+static void PlanTasks(Cell& top, const Transform& tra, Recdata& data, unsigned threads, std::vector<FlattenTask>& tasks)
+{
+	// Split the hierarchy in tasks for about 16 per thread, in the order
+	// Recurse visits them
+
+	Database* gds = data.gds;
+	std::vector<double> counts(gds->m_cells.size(), -1.0);
+
+	tasks.push_back({ &top, tra, false, CountPolys(gds, uint32_t(&top - gds->m_cells.data()), counts) });
+
+	// Split the largest subtree tasks until there are enough to balance the
+	// threads
+	while (tasks.size() < 16U * threads) {
+		size_t big = tasks.size();
+
+		for (size_t i = 0; i < tasks.size(); i++) {
+			if (!tasks[i].elements_only && (big == tasks.size() || tasks[i].polys > tasks[big].polys))
+				big = i;
+		}
+
+		if (big == tasks.size())
 			break;
-		case GDS_PATHTYPE:
 
-			if (curElem == PATH) {
-				curPath.pathtype = uint16_t(buf[0] << 8 | buf[1]);
-			}
+		std::vector<FlattenTask> parts;
+		SplitTask(tasks[big], data, counts, parts);
 
+		// Keep very large arrays whole once there is some work to share
+		if (tasks.size() > 1 && tasks.size() + parts.size() > 256U * threads)
 			break;
-		case GDS_STRANS: // SREF, AREF, TEXT
-			switch (curElem) {
-			case SREF:
-				curSRef.strans = uint16_t(buf[0] << 8 | buf[1]);
-				break;
-			case AREF:
-				curARef.strans = uint16_t(buf[0] << 8 | buf[1]);
-				break;
-			case BRY:
-			case PATH:
-				throw std::runtime_error("Invalid STRANS record");
-			case NONE:
-				break;
+
+		tasks.erase(tasks.begin() + big);
+		tasks.insert(tasks.begin() + big, parts.begin(), parts.end());
+	}
+}
+
+static void CollapseParallel(Cell& top, Transform tra, Recdata& data, unsigned threads)
+{
+	// Split the hierarchy in tasks, flatten the tasks on a work stealing pool
+	// with a polygon buffer per task and merge the buffers in task order. The
+	// output is the same as that of Recurse.
+
+	Database* gds = data.gds;
+	std::vector<FlattenTask> tasks;
+
+	PlanTasks(top, tra, data, threads, tasks);
+
+	size_t count = tasks.size();
+	std::vector<PolyBuffer> buffers(count);
+
+	// Tasks after the cutoff are not needed as the tasks before it already
+	// have max_polys polygons
+	std::mutex lock;
+	std::vector<uint8_t> done(count, 0);
+	size_t prefix = 0;
+	uint64_t prefix_polys = 0;
+	std::atomic<size_t> cutoff(count);
+
+	RunTasks(count, threads, [&](size_t k) {
+		if (k > cutoff)
+			return;
+
+		Recdata local{};
+
+		local.gds = gds;
+		local.usebbox = data.usebbox;
+		local.max_polys = data.max_polys;
+		local.pbuf = &buffers[k];
+		local.cache = data.cache;
+		local.clip = data.clip;
+		std::copy(data.bbox, data.bbox + 5, local.bbox);
+
+		if (tasks[k].elements_only)
+			RecurseElements(*tasks[k].cell, tasks[k].tra, local);
+		else
+			RecurseRef(uint32_t(tasks[k].cell - gds->m_cells.data()), tasks[k].tra, local);
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		done[k] = 1;
+		for (; prefix < count && done[prefix]; prefix++) {
+			prefix_polys += buffers[prefix].sizes.size();
+			if (prefix_polys >= data.max_polys && cutoff == count)
+				cutoff = prefix;
+		}
+	});
+
+	for (size_t k = 0; k < count && data.pcount < data.max_polys; k++) {
+		PolyBuffer& buf = buffers[k];
+		size_t offset = 0;
+
+		for (size_t i = 0; i < buf.sizes.size() && data.pcount < data.max_polys; i++) {
+			EmitPoly(&buf.pairs[offset], buf.sizes[i], buf.layers[i], buf.datatypes[i], data);
+			offset += buf.sizes[i];
+		}
+
+		buf = PolyBuffer();
+	}
+}
+
+// Functions to compute a density map while flattening
+
+// Pairs a thread collects before adding them to the tiles of the grid
+static const size_t DENSITY_PART_PAIRS = 0x10000;
+
+// Pairs of a tile above which its polygons are merged, once they are also
+// twice as many as were left by the last merge
+static const size_t DENSITY_MERGE_PAIRS = 0x10000;
+
+static int32_t TileEdge(int32_t lo, int32_t hi, double size, unsigned i)
+{
+	// The start of tile i along an axis, the last tile ending at hi
+	return int32_t(std::min(double(hi), lo + std::floor(size * i + 0.5)));
+}
+
+static void TileRange(const std::vector<int32_t>& edges, int32_t from, int32_t to, unsigned& first, unsigned& last)
+{
+	// The first and last tile along an axis that [from, to] overlaps by more
+	// than an edge, if any
+	first = unsigned(std::upper_bound(edges.begin() + 1, edges.end() - 1, from) - edges.begin()) - 1;
+	last = unsigned(std::lower_bound(edges.begin() + 1, edges.end() - 1, to) - edges.begin()) - 1;
+}
+
+static double PolyArea(const Pair* p, size_t n, bool& convex)
+{
+	// The area of an unclosed polygon and whether it is convex: turning
+	// one way only and going around once, so its area is what it covers
+
+	double area = 0.0;
+	int turn = 0, first = 0, dir = 0, changes = 0;
+
+	convex = true;
+
+	for (size_t i = 0; i < n; i++) {
+		const Pair& a = p[i];
+		const Pair& b = p[(i + 1) % n];
+		const Pair& c = p[(i + 2) % n];
+
+		area += double(a.x) * b.y - double(b.x) * a.y;
+
+		double cross = (double(b.x) - a.x) * (double(c.y) - b.y) - (double(b.y) - a.y) * (double(c.x) - b.x);
+		int sign = cross > 0.0 ? 1 : cross < 0.0 ? -1 : 0;
+
+		if (sign != 0 && turn != 0 && sign != turn)
+			convex = false;
+		if (sign != 0)
+			turn = sign;
+
+		// The direction along x changes twice going around once
+		int dx = b.x > a.x ? 1 : b.x < a.x ? -1 : 0;
+
+		if (dx != 0 && dir != 0 && dx != dir)
+			changes++;
+		if (dx != 0 && first == 0)
+			first = dx;
+		if (dx != 0)
+			dir = dx;
+	}
+
+	if (dir != first)
+		changes++;
+
+	convex = convex && changes <= 2;
+
+	return std::fabs(area) / 2.0;
+}
+
+static void MarkOverlaps(const std::vector<Pair>& boxes, std::vector<uint8_t>& overlap)
+{
+	// Mark the boxes, stored as (min, max) pairs one after the other, that
+	// overlap another by more than an edge. They are swept along x. The
+	// unmarked boxes crossing the sweep line do not overlap, so they are in
+	// order of y and a new box only needs to be tested against those from
+	// the one below it up to its top, and against the marked ones. Boxes
+	// the sweep line left are removed when met.
+
+	size_t count = boxes.size() / 2;
+	std::vector<uint32_t> order(count);
+
+	for (size_t i = 0; i < count; i++)
+		order[i] = uint32_t(i);
+
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return boxes[2 * a].x < boxes[2 * b].x; });
+
+	std::set<std::pair<int32_t, uint32_t>> active;
+	std::vector<uint32_t> marked;
+
+	overlap.assign(count, 0);
+
+	for (uint32_t i : order) {
+		const Pair* box = &boxes[2 * i];
+
+		for (size_t k = 0; k < marked.size();) {
+			const Pair* other = &boxes[2 * marked[k]];
+
+			if (other[1].x <= box[0].x) {
+				marked[k] = marked.back();
+				marked.pop_back();
+				continue;
 			}
-			break;
-		case GDS_ANGLE: // SREF, AREF, TEXT
-			switch (curElem) {
-			case SREF:
-				curSRef.angle = BufReadFloat(buf);
-				break;
-			case AREF:
-				curARef.angle = BufReadFloat(buf);
-				break;
-			case BRY:
-			case PATH:
-				throw std::runtime_error("Invalid ANGLE record");
-			case NONE:
+
+			if (other[0].y < box[1].y && other[1].y > box[0].y)
+				overlap[i] = 1;
+
+			k++;
+		}
+
+		auto it = active.lower_bound({ box[0].y, 0 });
+
+		while (it != active.begin()) {
+			auto prev = std::prev(it);
+			const Pair* other = &boxes[2 * prev->second];
+
+			if (other[1].x > box[0].x) {
+				if (other[1].y > box[0].y)
+					it = prev;
 				break;
 			}
-			break;
-		case GDS_MAG: // SREF, AREF, TEXT
-			switch (curElem) {
-			case SREF:
-				curSRef.mag = BufReadFloat(buf);
-				break;
-			case AREF:
-				curARef.mag = BufReadFloat(buf);
-				break;
-			case BRY:
-			case PATH:
-				throw std::runtime_error("Invalid MAG record");
-			case NONE:
-				break;
+
+			active.erase(prev);
+		}
+
+		while (it != active.end() && it->first < box[1].y) {
+			uint32_t j = it->second;
+
+			if (boxes[2 * j + 1].x > box[0].x) {
+				overlap[i] = overlap[j] = 1;
+				marked.push_back(j);
 			}
-			break;
-		case GDS_XY:
-			switch (curElem) {
-			case BRY:
-				{
-					// number of pairs
-					size_t count = buf_size / 8U;
-
-					if (count >= 8191)
-						throw std::runtime_error("Invalid XY record data for BOUNDARY");
-
-					for (unsigned int n = 0; n < count; n++) {
-
-						unsigned int i = 8 * n;
-						int x = buf[i] << 24 | buf[i + 1] << 16 | buf[i + 2] << 8 | buf[i + 3];
-						int y = buf[i + 4] << 24 | buf[i + 5] << 16 | buf[i + 6] << 8 | buf[i + 7];
-
-						Pair pair = { x, y };
-						curBndry.pairs.push_back(pair);
-					}
-					break;
-				}
-			case SREF:
-				curSRef.x = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
-				curSRef.y = buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
-				break;
-			case AREF:
-				curARef.x1 = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
-				curARef.y1 = buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
-				curARef.x2 = buf[8] << 24 | buf[9] << 16 | buf[10] << 8 | buf[11];
-				curARef.y2 = buf[12] << 24 | buf[13] << 16 | buf[14] << 8 | buf[15];
-				curARef.x3 = buf[16] << 24 | buf[17] << 16 | buf[18] << 8 | buf[19];
-				curARef.y3 = buf[20] << 24 | buf[21] << 16 | buf[22] << 8 | buf[23];
-				break;
-			case PATH:
-				{
-					// number of pairs
-					size_t count = buf_size / 8U;
-
-					if (count >= 8191)
-						throw std::runtime_error("Invalid XY record data for PATH");
-
-					for (unsigned int n = 0; n < count; n++) {
-						unsigned int i = 8U * n;
-						int x = buf[i] << 24 | buf[i + 1] << 16 | buf[i + 2] << 8 | buf[i + 3];
-						int y = buf[i + 4] << 24 | buf[i + 5] << 16 | buf[i + 6] << 8 | buf[i + 7];
-
-						Pair pair = { x, y };
-						curPath.pairs.push_back(pair);
-					}
-				}
-				break;
-			case NONE:
+
+			it = active.erase(it);
+		}
+
+		if (overlap[i])
+			marked.push_back(i);
+		else
+			active.insert({ box[0].y, i });
+	}
+}
+
+static void TilePolys(DensityTile& tile, uint16_t layer, std::vector<Polygon>& polys)
+{
+	size_t offset = 0;
+
+	for (uint32_t size : tile.sizes) {
+		polys.push_back(Polygon(&tile.pairs[offset], size, layer));
+		offset += size;
+	}
+}
+
+static void MergeTile(DensityTile& tile, uint16_t layer)
+{
+	// Replace the polygons of a tile with their union, in trapezoids whose
+	// corners where edges at other angles cross are rounded to the grid
+
+	std::vector<Polygon> polys, merged;
+
+	TilePolys(tile, layer, polys);
+	Merge(polys, merged);
+
+	tile.pairs.clear();
+	tile.sizes.clear();
+
+	for (const Polygon& poly : merged) {
+		tile.pairs.insert(tile.pairs.end(), poly.m_pairs.begin(), poly.m_pairs.end());
+		tile.sizes.push_back(uint32_t(poly.m_pairs.size()));
+	}
+
+	tile.merged = tile.pairs.size();
+}
+
+static double TileArea(DensityTile& tile, uint16_t layer)
+{
+	// The area the polygons of a tile cover. The convex polygons that do
+	// not overlap another are summed; the others are merged first.
+
+	size_t count = tile.sizes.size();
+	std::vector<Pair> boxes(2 * count);
+	std::vector<double> areas(count);
+	std::vector<uint8_t> convex(count);
+	size_t offset = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		const Pair* p = &tile.pairs[offset];
+		size_t n = tile.sizes[i] - 1;
+		bool c;
+
+		boxes[2 * i] = { INT_MAX, INT_MAX };
+		boxes[2 * i + 1] = { INT_MIN, INT_MIN };
+		AddToBox(&boxes[2 * i], p, n);
+
+		areas[i] = PolyArea(p, n, c);
+		convex[i] = c;
+		offset += tile.sizes[i];
+	}
+
+	std::vector<uint8_t> overlap;
+	double area = 0.0;
+	std::vector<Polygon> merge;
+
+	MarkOverlaps(boxes, overlap);
+	offset = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!overlap[i] && convex[i])
+			area += areas[i];
+		else
+			merge.push_back(Polygon(&tile.pairs[offset], tile.sizes[i], layer));
+
+		offset += tile.sizes[i];
+	}
+
+	if (!merge.empty()) {
+		std::vector<std::pair<uint16_t, double>> merged;
+
+		BooleanArea(merge, std::vector<Polygon>(), BoolOp::OR, merged);
+
+		for (const auto& it : merged)
+			area += it.second;
+	}
+
+	return area;
+}
+
+static void FlushDensity(DensityPart& part)
+{
+	// Add the polygons of a thread to the tiles of the grid, in order of
+	// tile
+
+	DensityGrid& grid = *part.grid;
+	size_t count = part.polys.size();
+	std::vector<size_t> offsets(count + 1, 0);
+	std::vector<uint32_t> order(count);
+
+	for (size_t i = 0; i < count; i++) {
+		offsets[i + 1] = offsets[i] + part.polys[i].second;
+		order[i] = uint32_t(i);
+	}
+
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return part.polys[a].first < part.polys[b].first || (part.polys[a].first == part.polys[b].first && a < b);
+	});
+
+	for (size_t i = 0; i < count;) {
+		uint64_t key = part.polys[order[i]].first;
+		size_t end = i;
+
+		while (end < count && part.polys[order[end]].first == key)
+			end++;
+
+		size_t stripe = size_t((key >> 16) * 31 + (key & 0xFFFF)) % DensityGrid::STRIPES;
+
+		std::lock_guard<std::mutex> guard(grid.locks[stripe]);
+		DensityTile& tile = grid.tiles[stripe][key];
+
+		for (; i < end && !tile.full; i++) {
+			uint32_t k = order[i];
+
+			if (part.polys[k].second == 0) {
+				tile = DensityTile();
+				tile.full = true;
 				break;
 			}
-			break;
-		case GDS_LAYER: // BOUNDARY, PATH, TEXT, NODE, BOX
-			switch (curElem) {
-			case BRY:
-				curBndry.layer = uint16_t(buf[0] << 8 | buf[1]);
-				break;
-			case PATH:
-				curPath.layer = uint16_t(buf[0] << 8 | buf[1]);
+
+			tile.pairs.insert(tile.pairs.end(), part.pairs.begin() + offsets[k], part.pairs.begin() + offsets[k + 1]);
+			tile.sizes.push_back(part.polys[k].second);
+		}
+
+		i = end;
+
+		if (tile.pairs.size() > std::max(DENSITY_MERGE_PAIRS, 2 * tile.merged))
+			MergeTile(tile, uint16_t(key & 0xFFFF));
+	}
+
+	part.pairs.clear();
+	part.polys.clear();
+}
+
+static void AddDensity(Pair* pairs, size_t size, uint16_t layer, DensityPart& part)
+{
+	// Cut a polygon to every tile it overlaps and collect the parts
+
+	const DensityGrid& grid = *part.grid;
+	Pair box[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
+	unsigned col0, col1, row0, row1;
+
+	AddToBox(box, pairs, size - 1);
+	TileRange(grid.xs, box[0].x, box[1].x, col0, col1);
+	TileRange(grid.ys, box[0].y, box[1].y, row0, row1);
+
+	for (unsigned row = row0; row <= row1; row++) {
+		for (unsigned col = col0; col <= col1; col++) {
+			Pair tile[3];
+
+			tile[0] = { grid.xs[col], grid.ys[row] };
+			tile[2] = { grid.xs[col + 1], grid.ys[row + 1] };
+
+			size_t n = size;
+			Pair* p = ClipPoly(pairs, n, tile);
+
+			if (!p)
+				continue;
+
+			uint64_t key = (uint64_t(row) * grid.cols + col) << 16 | layer;
+
+			// A rectangle as large as the tile covers it
+			bool covers = n == 5;
+
+			for (size_t i = 0; i < 4 && covers; i++) {
+				covers = (p[i].x == tile[0].x || p[i].x == tile[2].x) && (p[i].y == tile[0].y || p[i].y == tile[2].y) &&
+					(p[i].x == p[i + 1].x || p[i].y == p[i + 1].y);
+			}
+
+			if (covers && p[0].x != p[2].x && p[0].y != p[2].y) {
+				part.polys.push_back({ key, 0 });
+				continue;
+			}
+
+			part.pairs.insert(part.pairs.end(), p, p + n);
+			part.polys.push_back({ key, uint32_t(n) });
+		}
+	}
+
+	if (part.pairs.size() >= DENSITY_PART_PAIRS)
+		FlushDensity(part);
+}
+
+// Functions to decode the records of a GDS file
+
+static int32_t BufReadInt(const uint8_t* p)
+{
+	return int32_t(uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]));
+}
+
+static uint16_t BufReadShort(const uint8_t* p)
+{
+	return uint16_t(p[0] << 8 | p[1]);
+}
+
+static uint32_t BufReadName(Parser& state, const uint8_t* buf, size_t size)
+{
+	// Intern a (possibly NUL padded) name directly from the record data. The
+	// lookup reuses the key buffer, so known names do not allocate.
+
+	size = std::find(buf, buf + size, 0) - buf;
+
+	state.key.assign((const char*)buf, size);
+
+	auto it = state.nameIndex.find(state.key);
+	if (it != state.nameIndex.end())
+		return it->second;
+
+	uint32_t id = uint32_t(state.names.size());
+
+	state.names.push_back(state.key);
+	state.nameIndex.emplace(state.key, id);
+
+	return id;
+}
+
+static uint32_t AddName(Database* gds, const std::wstring& name)
+{
+	auto it = gds->m_nameIndex.emplace(name, uint32_t(gds->m_names.size()));
+
+	if (it.second)
+		gds->m_names.push_back(name);
+
+	return it.first->second;
+}
+
+static void MergeNames(Database* gds, Parser& state, Cell* cells, size_t count)
+{
+	// Add the names interned by a parser to the name table of the database
+	// and renumber the names in the cells it read.
+
+	std::vector<uint32_t> ids(state.names.size());
+
+	for (size_t i = 0; i < state.names.size(); i++)
+		ids[i] = AddName(gds, to_wstring(state.names[i]));
+
+	for (size_t i = 0; i < count; i++) {
+		cells[i].strname = ids[cells[i].strname];
+
+		for (auto it = std::begin(cells[i].srefs); it != std::end(cells[i].srefs); ++it)
+			it->sname = ids[it->sname];
+		for (auto it = std::begin(cells[i].arefs); it != std::end(cells[i].arefs); ++it)
+			it->sname = ids[it->sname];
+	}
+}
+
+static uint32_t BufReadPairs(std::vector<Pair>& pairs, const uint8_t* buf, size_t size)
+{
+	// Append the pairs to the vertex arena of the cell and return their number
+
+	size_t count = size / 8U;
+	size_t start = pairs.size();
+
+	pairs.resize(start + count);
+	DecodePairs(pairs.data() + start, buf, count);
+
+	return uint32_t(count);
+}
+
+static bool SkipPairs(Parser& state, uint16_t layer, uint16_t datatype)
+{
+	// Whether to skip the XY record of an element, known by its LAYER and
+	// DATATYPE records that come before it
+
+	const LayerFilter* filter = state.gds->m_loadFilter.get();
+
+	if (filter && !filter->Selected(layer, datatype))
+		state.skipElem = true;
+
+	return state.skipElem;
+}
+
+static bool KeepElement(Parser& state, uint16_t layer, uint16_t datatype, uint32_t offset)
+{
+	// Whether to add an element at its ENDEL; the pairs of one that is not
+	// are dropped from the arena
+
+	const LayerFilter* filter = state.gds->m_loadFilter.get();
+	bool keep = !state.skipElem && (!filter || filter->Selected(layer, datatype));
+
+	if (!keep)
+		state.curCell.pairs.resize(offset);
+
+	state.skipElem = false;
+
+	return keep;
+}
+
+static void ParseRecord(Parser& state, uint16_t record_type, const uint8_t* buf, uint16_t buf_size)
+{
+	Database* gds = state.gds;
+
+	// Handle the GDS records
+	switch (record_type) {
+	case GDS_HEADER:
+		if (state.offset != 0)
+		{
+			// GDH_HEADER should be the first record of a GDS file
+			throw std::runtime_error("GDS file should start with HEADER record");
+		}
+		if (buf_size == 2)
+		{
+			gds->m_version = BufReadShort(buf);
+			if (gds->m_version != 600 && gds->m_version != 6)
+			{
+				throw std::runtime_error("Unsupported GDS version");
+			}
+		}
+		break;
+	case GDS_BGNLIB:
+		break;
+	case GDS_ENDLIB:
+		state.readEndlib = true;
+		break;
+	case GDS_LIBNAME:
+		{
+			// add to libnames after converting to wide
+
+			std::string s((const char*)buf, buf_size);
+
+			gds->m_libnames.push_back(to_wstring(s));
+		}
+		break;
+	case GDS_BGNSTR:
+		state.cell_count++;
+		break;
+	case GDS_ENDSTR:
+		state.cells->push_back(std::move(state.curCell));
+		state.curCell = {};
+		break;
+	case GDS_UNITS:
+		{
+			gds->m_uu_per_dbunit = BufReadFloat(buf);
+			gds->m_meter_per_dbunit = BufReadFloat(buf + 8);
+
+			if (buf_size == 16)
+				memcpy(gds->m_units, buf, 16); // also store the buffer raw data
+
+			break;
+		}
+	case GDS_STRNAME:
+		state.curCell.strname = BufReadName(state, buf, buf_size);
+		break;
+	case GDS_BOUNDARY:
+		state.curElem = Parser::BRY;
+		state.curBndry.offset = uint32_t(state.curCell.pairs.size());
+		break;
+	case GDS_PATH:
+		state.curElem = Parser::PATH;
+		state.curPath.offset = uint32_t(state.curCell.pairs.size());
+		break;
+	case GDS_SREF:
+		state.curElem = Parser::SREF;
+		break;
+	case GDS_AREF:
+		state.curElem = Parser::AREF;
+		break;
+	case GDS_TEXT:
+		break;
+	case GDS_NODE:
+		break;
+	case GDS_BOX:
+		break;
+	case GDS_ENDEL:
+		// add element to the current structure
+
+		switch (state.curElem) {
+		case Parser::BRY:
+			if (KeepElement(state, state.curBndry.layer, state.curBndry.datatype, state.curBndry.offset))
+				state.curCell.boundaries.push_back(state.curBndry);
+			state.curBndry = {};
+			state.curElem = Parser::NONE;
+			break;
+		case Parser::PATH:
+			if (KeepElement(state, state.curPath.layer, state.curPath.datatype, state.curPath.offset))
+				state.curCell.paths.push_back(state.curPath);
+			state.curPath = {};
+			state.curElem = Parser::NONE;
+			break;
+		case Parser::SREF:
+			state.curCell.srefs.push_back(state.curSRef);
+			state.curSRef = {};
+			state.curElem = Parser::NONE;
+			break;
+		case Parser::AREF:
+			state.curCell.arefs.push_back(state.curARef);
+			state.curARef = {};
+			state.curElem = Parser::NONE;
+			break;
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_SNAME: // SREF, AREF
+		switch (state.curElem) {
+		case Parser::SREF:
+			state.curSRef.sname = BufReadName(state, buf, buf_size);
+			break;
+		case Parser::AREF:
+			state.curARef.sname = BufReadName(state, buf, buf_size);
+			break;
+		case Parser::BRY:
+		case Parser::PATH:
+			throw std::runtime_error("Invalid SNAME record");
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_COLROW: // AREF
+		if (state.curElem == Parser::AREF) {
+			state.curARef.col = BufReadShort(buf);
+			state.curARef.row = BufReadShort(buf + 2);
+		}
+		break;
+	case GDS_PATHTYPE:
+
+		if (state.curElem == Parser::PATH) {
+			state.curPath.pathtype = BufReadShort(buf);
+		}
+
+		break;
+	case GDS_STRANS: // SREF, AREF, TEXT
+		switch (state.curElem) {
+		case Parser::SREF:
+			state.curSRef.strans = BufReadShort(buf);
+			break;
+		case Parser::AREF:
+			state.curARef.strans = BufReadShort(buf);
+			break;
+		case Parser::BRY:
+		case Parser::PATH:
+			throw std::runtime_error("Invalid STRANS record");
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_ANGLE: // SREF, AREF, TEXT
+		switch (state.curElem) {
+		case Parser::SREF:
+			state.curSRef.angle = BufReadFloat(buf);
+			break;
+		case Parser::AREF:
+			state.curARef.angle = BufReadFloat(buf);
+			break;
+		case Parser::BRY:
+		case Parser::PATH:
+			throw std::runtime_error("Invalid ANGLE record");
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_MAG: // SREF, AREF, TEXT
+		switch (state.curElem) {
+		case Parser::SREF:
+			state.curSRef.mag = BufReadFloat(buf);
+			break;
+		case Parser::AREF:
+			state.curARef.mag = BufReadFloat(buf);
+			break;
+		case Parser::BRY:
+		case Parser::PATH:
+			throw std::runtime_error("Invalid MAG record");
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_XY:
+		switch (state.curElem) {
+		case Parser::BRY:
+			if (buf_size / 8U >= 8191)
+				throw std::runtime_error("Invalid XY record data for BOUNDARY");
+
+			if (SkipPairs(state, state.curBndry.layer, state.curBndry.datatype))
 				break;
-			case SREF:
-			case AREF:
-				throw std::runtime_error("Invalid LAYER record");
-			case NONE:
+
+			state.curBndry.count += BufReadPairs(state.curCell.pairs, buf, buf_size);
+			break;
+		case Parser::SREF:
+			state.curSRef.x = BufReadInt(buf);
+			state.curSRef.y = BufReadInt(buf + 4);
+			break;
+		case Parser::AREF:
+			state.curARef.x1 = BufReadInt(buf);
+			state.curARef.y1 = BufReadInt(buf + 4);
+			state.curARef.x2 = BufReadInt(buf + 8);
+			state.curARef.y2 = BufReadInt(buf + 12);
+			state.curARef.x3 = BufReadInt(buf + 16);
+			state.curARef.y3 = BufReadInt(buf + 20);
+			break;
+		case Parser::PATH:
+			if (buf_size / 8U >= 8191)
+				throw std::runtime_error("Invalid XY record data for PATH");
+
+			if (SkipPairs(state, state.curPath.layer, state.curPath.datatype))
 				break;
-			}
+
+			state.curPath.count += BufReadPairs(state.curCell.pairs, buf, buf_size);
+			break;
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_LAYER: // BOUNDARY, PATH, TEXT, NODE, BOX
+		switch (state.curElem) {
+		case Parser::BRY:
+			state.curBndry.layer = BufReadShort(buf);
 			break;
-		case GDS_WIDTH: // PATH, TEXT
+		case Parser::PATH:
+			state.curPath.layer = BufReadShort(buf);
+			break;
+		case Parser::SREF:
+		case Parser::AREF:
+			throw std::runtime_error("Invalid LAYER record");
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_WIDTH: // PATH, TEXT
+
+		if (state.curElem == Parser::PATH) {
+			state.curPath.width = uint32_t(BufReadInt(buf));
+		}
+
+		break;
+	case GDS_DATATYPE: // BOUNDARY, PATH
+		switch (state.curElem) {
+		case Parser::BRY:
+			state.curBndry.datatype = BufReadShort(buf);
+			break;
+		case Parser::PATH:
+			state.curPath.datatype = BufReadShort(buf);
+			break;
+		case Parser::SREF:
+		case Parser::AREF:
+			throw std::runtime_error("Invalid DATATYPE record");
+		case Parser::NONE:
+			break;
+		}
+		break;
+	case GDS_TEXTNODE:
+		break;
+	case GDS_TEXTTYPE:
+		break;
+	case GDS_PRESENTATION:
+		break;
+	case GDS_STRING:
+		break;
+	case GDS_REFLIBS:
+		break;
+	case GDS_FONTS:
+		break;
+	case GDS_ATTRTABLE:
+		break;
+	case GDS_ELFLAGS:
+		break;
+	case GDS_PROPATTR:
+		break;
+	case GDS_PROPVALUE:
+		break;
+	case GDS_BOXTYPE:
+		break;
+	case GDS_PLEX:
+		break;
+	case GDS_BGNEXTN:
+		break;
+	case GDS_ENDEXTN:
+		break;
+	case GDS_FORMAT:
+		break;
+	default:
+		throw std::runtime_error("Unknown GDS record type");
+	}
+}
+
+static size_t ScanRecord(const uint8_t* data, size_t size, size_t pos, uint16_t& record_type)
+{
+	// Validate the record at pos and return its length
+
+	uint16_t record_len;
+
+	if (size - pos < 4)
+		throw std::runtime_error("Unexpected end of GDS file");
+
+	// First 2 bytes: record length; second 2 bytes record type and data type
+	record_len = BufReadShort(data + pos);
+	record_type = BufReadShort(data + pos + 2);
+
+	// Minimum record length is 4
+	if (record_len < 4) {
+		throw std::runtime_error("Invalid GDS record (size < 4) found");
+	}
+	if (record_len > size - pos) {
+		throw std::runtime_error("Unexpected end of GDS file");
+	}
+
+	return record_len;
+}
+
+static void ScanLibrary(Parser& state, const uint8_t* data, size_t size, std::vector<StructRange>& ranges)
+{
+	// First pass over the mapped file: decode the library records and only
+	// note the byte range of every BGNSTR..ENDSTR block.
+
+	size_t pos = 0, begin = 0;
+	bool in_str = false;
+
+	while (!state.readEndlib)
+	{
+		uint16_t record_type;
+		size_t record_len = ScanRecord(data, size, pos, record_type);
+
+		if (in_str) {
+			if (record_type == GDS_ENDSTR) {
+				ranges.push_back({ begin, pos + record_len });
+				in_str = false;
+			}
+		} else if (record_type == GDS_BGNSTR) {
+			begin = pos;
+			in_str = true;
+		} else {
+			state.offset = pos;
+			ParseRecord(state, record_type, data + pos + 4, uint16_t(record_len - 4U));
+		}
+
+		pos += record_len;
+	}
+}
+
+static uint64_t HashBytes(const uint8_t* p, size_t size)
+{
+	// 64 bit hash of a byte range, 32 bytes at a time in four independent
+	// lanes, with the round and final mix of xxHash64
+
+	const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL;
+
+	auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto round = [&](uint64_t h, uint64_t v) { return rotl(h + v * P2, 31) * P1; };
+
+	uint64_t lanes[4] = { P1 + P2, P2, 0, 0 - P1 };
+	uint64_t h = size * P1;
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		for (int k = 0; k < 4; k++) {
+			uint64_t v;
+
+			memcpy(&v, p + i + 8 * k, 8);
+			lanes[k] = round(lanes[k], v);
+		}
+	}
+
+	for (int k = 0; k < 4; k++)
+		h = (h ^ round(0, lanes[k])) * P1 + P2;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t v;
+
+		memcpy(&v, p + i, 8);
+		h = rotl(h ^ round(0, v), 27) * P1 + P2;
+	}
+
+	for (; i < size; i++)
+		h = rotl(h ^ (p[i] * P1), 11) * P2;
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P1;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static void FingerprintRanges(const uint8_t* data, const std::vector<StructRange>& ranges, unsigned threads, std::vector<uint64_t>& out)
+{
+	// Hash every structure without its BGNSTR record, which only holds the
+	// dates it was created and modified
+
+	const size_t CHUNK = 256;
+
+	out.resize(ranges.size());
+
+	RunTasks((ranges.size() + CHUNK - 1) / CHUNK, threads, [&](size_t k) {
+		size_t end = std::min(ranges.size(), (k + 1) * CHUNK);
+
+		for (size_t i = k * CHUNK; i < end; i++) {
+			size_t begin = ranges[i].begin + BufReadShort(data + ranges[i].begin);
+
+			out[i] = HashBytes(data + begin, ranges[i].end - begin);
+		}
+	});
+}
+
+static void CopyRanges(const uint8_t* data, const std::vector<StructRange>& ranges, std::vector<uint8_t>& bytes, std::vector<size_t>& offsets)
+{
+	// Keep the bytes FingerprintRanges hashes, one structure after the
+	// other, so that a structure with the same fingerprint can be compared
+
+	offsets.assign(1, 0);
+
+	for (const StructRange& range : ranges)
+		offsets.push_back(offsets.back() + range.end - range.begin - BufReadShort(data + range.begin));
+
+	bytes.resize(offsets.back());
+
+	for (size_t i = 0; i < ranges.size(); i++)
+		memcpy(bytes.data() + offsets[i], data + ranges[i].begin + BufReadShort(data + ranges[i].begin), offsets[i + 1] - offsets[i]);
+}
+
+static void ParseRange(Parser& state, const uint8_t* data, StructRange range)
+{
+	// Decode the (already validated) records of one structure in place,
+	// with room for the pairs of all its XY records reserved up front
+
+	size_t pos = range.begin, pairs = 0;
+
+	for (; pos < range.end; pos += BufReadShort(data + pos)) {
+		if (BufReadShort(data + pos + 2) == GDS_XY)
+			pairs += (BufReadShort(data + pos) - 4U) / 8U;
+	}
+
+	state.curCell.pairs.reserve(pairs);
+
+	pos = range.begin;
+
+	while (pos < range.end)
+	{
+		size_t record_len = BufReadShort(data + pos);
+
+		state.offset = pos;
+		ParseRecord(state, BufReadShort(data + pos + 2), data + pos + 4, uint16_t(record_len - 4U));
+
+		pos += record_len;
+	}
+}
+
+static void ParseStructures(Database* gds, const uint8_t* data, const std::vector<StructRange>& ranges, unsigned threads, std::vector<Cell>& cells)
+{
+	// Second pass: decode the structures. Consecutive structures are grouped
+	// in chunks of roughly equal size which are handed out to the threads;
+	// the cells of the chunks are appended to cells in file order.
+
+	size_t total = ranges.empty() ? 0 : ranges.back().end - ranges.front().begin;
+
+	cells.reserve(cells.size() + ranges.size());
+
+	// Not worth the threads for small libraries
+	if (threads < 2 || ranges.size() < 2 * threads || total < 0x100000) {
+		Parser state{};
+		size_t start = cells.size();
+
+		state.gds = gds;
+		state.cells = &cells;
+
+		for (auto it = ranges.begin(); it != ranges.end(); ++it)
+			ParseRange(state, data, *it);
+
+		MergeNames(gds, state, cells.data() + start, cells.size() - start);
+		return;
+	}
+
+	// Index of the first structure of every chunk
+	std::vector<size_t> first;
+	size_t chunk_size = total / (8U * threads) + 1;
+	size_t chunk_end = 0;
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (first.empty() || ranges[i].begin >= chunk_end) {
+			first.push_back(i);
+			chunk_end = ranges[i].begin + chunk_size;
+		}
+	}
+	first.push_back(ranges.size());
+
+	size_t chunks = first.size() - 1;
+	std::vector<Parser> parsers(chunks);
+	std::vector<std::vector<Cell>> chunk_cells(chunks);
+
+	RunTasks(chunks, threads, [&](size_t k) {
+		parsers[k].gds = gds;
+		parsers[k].cells = &chunk_cells[k];
+
+		for (size_t i = first[k]; i < first[k + 1]; i++)
+			ParseRange(parsers[k], data, ranges[i]);
+	});
+
+	// Names are numbered in order of first appearance in the file
+	for (size_t k = 0; k < chunks; k++) {
+		MergeNames(gds, parsers[k], chunk_cells[k].data(), chunk_cells[k].size());
+
+		for (auto& cell : chunk_cells[k])
+			cells.push_back(std::move(cell));
+	}
+}
+
+static void ParseFile(Parser& state, FILE* p_file)
+{
+	// Fallback for files that cannot be mapped: read record by record into a
+	// single buffer large enough for the largest possible record. The records
+	// of a structure are collected and decoded at its ENDSTR, as ParseRange
+	// does for a mapped file.
+
+	std::vector<uint8_t> buf(0x10000), str(0x10000);
+	size_t str_size = 0; // Bytes of the structure in str so far
+
+	while (!state.readEndlib)
+	{
+		uint8_t rheader[4];
+		uint16_t buf_size, record_len, record_type;
+
+		if (fread(rheader, 1, 4, p_file) != 4)
+			throw std::runtime_error("Unexpected end of GDS file");
+
+		// First 2 bytes: record length; second 2 bytes record type and data type
+		record_len = BufReadShort(rheader);
+		record_type = BufReadShort(rheader + 2);
+
+		// Minimum record length is 4
+		if (record_len < 4) {
+			throw std::runtime_error("Invalid GDS record (size < 4) found");
+		}
+
+		// The size of the additional data in bytes
+		buf_size = record_len - 4U;
+
+		if (record_type == GDS_BGNSTR || str_size) {
+			if (str_size + record_len > str.size())
+				str.resize(2 * str.size());
+
+			memcpy(str.data() + str_size, rheader, 4);
+
+			if (fread(str.data() + str_size + 4, 1, buf_size, p_file) != buf_size)
+				throw std::runtime_error("Unexpected end of GDS file");
+
+			str_size += record_len;
+
+			if (record_type == GDS_ENDSTR) {
+				size_t offset = state.offset; // Of the BGNSTR
+
+				ParseRange(state, str.data(), { 0, str_size });
+				state.offset = offset + str_size;
+				str_size = 0;
+			}
+
+			continue;
+		}
+
+		if (fread(buf.data(), 1, buf_size, p_file) != buf_size)
+			throw std::runtime_error("Unexpected end of GDS file");
+
+		ParseRecord(state, record_type, buf.data(), buf_size);
+
+		state.offset += record_len;
+	}
+}
+
+// Read-only mapping of a whole file
+
+MappedFile::~MappedFile()
+{
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+bool MappedFile::Open(const wchar_t* path)
+{
+	LARGE_INTEGER file_size;
+
+	file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		return false;
+
+	mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+		return false;
+
+	data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+		return false;
+
+	size = size_t(file_size.QuadPart);
+
+	return true;
+}
+
+static void LoadFile(Database* gds, const wchar_t* file, bool map_file, unsigned threads)
+{
+	Parser state{};
+
+	state.gds = gds;
+	state.cells = &gds->m_cells;
+
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	// Parse the file directly in a memory mapped view when possible
+	if (map_file)
+	{
+		MappedFile mapped;
+
+		if (mapped.Open(file))
+		{
+			std::vector<StructRange> ranges;
+
+			ScanLibrary(state, mapped.data, mapped.size, ranges);
+			ParseStructures(gds, mapped.data, ranges, threads, gds->m_cells);
+			FingerprintRanges(mapped.data, ranges, threads, gds->m_fingerprints);
+			CopyRanges(mapped.data, ranges, gds->m_structBytes, gds->m_structOffsets);
+			return;
+		}
+	}
+
+	FILE* p_file = nullptr;
+	_wfopen_s(&p_file, file, L"rb");
+
+	if (!p_file)
+	{
+		throw std::runtime_error("Could not find or open GDS file");
+	}
+
+	try
+	{
+		ParseFile(state, p_file);
+		MergeNames(gds, state, gds->m_cells.data(), gds->m_cells.size());
+	}
+	catch (...)
+	{
+		fclose(p_file);
+		throw;
+	}
+
+	fclose(p_file);
+}
+
+static void LinkCells(Database* gds)
+{
+	// Build the parent/child graph of the cells in a single pass over the
+	// (resolved) references. Each cell lists every other cell only once.
+
+	for (uint32_t i = 0; i < gds->m_cells.size(); i++) {
+		Cell& cell = gds->m_cells[i];
+
+		cell.children.clear();
+		for (auto it = std::begin(cell.srefs); it != std::end(cell.srefs); ++it) {
+			if (it->cell != GDS_NO_CELL)
+				cell.children.push_back(it->cell);
+		}
+		for (auto it = std::begin(cell.arefs); it != std::end(cell.arefs); ++it) {
+			if (it->cell != GDS_NO_CELL)
+				cell.children.push_back(it->cell);
+		}
+
+		std::sort(cell.children.begin(), cell.children.end());
+		cell.children.erase(std::unique(cell.children.begin(), cell.children.end()), cell.children.end());
+	}
+
+	for (auto it = std::begin(gds->m_cells); it != std::end(gds->m_cells); ++it) {
+		it->parents.clear();
+	}
+
+	// Parents end up sorted by index as the cells are visited in order
+	for (uint32_t i = 0; i < gds->m_cells.size(); i++) {
+		for (auto it = std::begin(gds->m_cells[i].children); it != std::end(gds->m_cells[i].children); ++it) {
+			gds->m_cells[*it].parents.push_back(i);
+		}
+	}
+}
+
+static void AddRefToBox(Pair* box, const Cell& ref, Transform tra)
+{
+	Pair tbox[2];
+
+	if (ref.bbox[0].x > ref.bbox[1].x)
+		return;
+
+	TransformBox(tbox, ref.bbox, tra);
+	AddToBox(box, tbox, 2);
+}
+
+static void BoundCell(Database* gds, Cell& cell)
+{
+	// Bounding box of a cell including the cells it references, which must
+	// have been bounded already.
+
+	Pair* box = cell.bbox;
+
+	box[0] = { INT_MAX, INT_MAX };
+	box[1] = { INT_MIN, INT_MIN };
+
+	for (auto it = std::begin(cell.boundaries); it != std::end(cell.boundaries); ++it) {
+		AddToBox(box, &cell.pairs[it->offset], it->count);
+	}
+
+	for (auto it = std::begin(cell.paths); it != std::end(cell.paths); ++it) {
+		if (it->count < 2)
+			continue;
+
+		size_t out_size = 2 * size_t(it->count) + 1U;
+		Pair* tmp = GrowBuffer(ThreadScratch().path, out_size);
+
+		ExpandPath(tmp, &cell.pairs[it->offset], it->count, it->width, it->pathtype);
+		AddToBox(box, tmp, out_size);
+	}
+
+	for (auto it = std::begin(cell.srefs); it != std::end(cell.srefs); ++it) {
+		if (it->cell == GDS_NO_CELL)
+			continue;
+
+		Transform tra = AccumulateTransform(Transform(), it->x, it->y, it->strans, it->mag, it->angle);
+		AddRefToBox(box, gds->m_cells[it->cell], tra);
+	}
+
+	for (auto it = std::begin(cell.arefs); it != std::end(cell.arefs); ++it) {
+		if (it->cell == GDS_NO_CELL || it->col == 0 || it->row == 0)
+			continue;
+
+		// The origins are linear in (col, row): the corner references of the
+		// array cover all the others
+		int cols[2] = { 0, it->col - 1 };
+		int rows[2] = { 0, it->row - 1 };
+
+		for (int c = 0; c < 2; c++) {
+			for (int r = 0; r < 2; r++) {
+				Pair ref = ArefOrigin(&*it, cols[c], rows[r]);
+				Transform tra = AccumulateTransform(Transform(), ref.x, ref.y, it->strans, it->mag, it->angle);
+				AddRefToBox(box, gds->m_cells[it->cell], tra);
+			}
+		}
+	}
+}
+
+static void BottomUp(Database* gds, std::vector<uint32_t>& order)
+{
+	// Order the cells so that every cell comes after the cells it references,
+	// with an explicit depth first walk over the children.
+
+	std::vector<uint8_t> visited(gds->m_cells.size(), 0);
+	std::vector<std::pair<uint32_t, size_t>> stack;
+
+	order.clear();
+	order.reserve(gds->m_cells.size());
+
+	for (uint32_t i = 0; i < gds->m_cells.size(); i++) {
+		if (visited[i])
+			continue;
+
+		visited[i] = 1;
+		stack.push_back({ i, 0 });
+
+		while (!stack.empty()) {
+			const Cell& cell = gds->m_cells[stack.back().first];
+
+			if (stack.back().second < cell.children.size()) {
+				uint32_t child = cell.children[stack.back().second++];
+
+				// A child still on the stack is a recursive reference
+				if (!visited[child]) {
+					visited[child] = 1;
+					stack.push_back({ child, 0 });
+				}
+			} else {
+				order.push_back(stack.back().first);
+				stack.pop_back();
+			}
+		}
+	}
+}
+
+static void BoundCells(Database* gds, const std::vector<uint32_t>& order)
+{
+	// Compute the bounding boxes of the cells bottom up
+
+	for (uint32_t cell : order)
+		BoundCell(gds, gds->m_cells[cell]);
+}
+
+static void SelectCells(Database* gds, const std::vector<uint32_t>& order)
+{
+	// Mark the cells in order that have elements selected by the filter
+	// themselves or in a cell they reference
+
+	const LayerFilter* filter = gds->m_filter.get();
+
+	if (!filter) {
+		gds->m_cellSelected.assign(gds->m_cells.size(), 1);
+		return;
+	}
+
+	gds->m_cellSelected.resize(gds->m_cells.size(), 0);
+
+	for (uint32_t i : order) {
+		const Cell& cell = gds->m_cells[i];
+		uint8_t selected = 0;
+
+		for (auto it = std::begin(cell.boundaries); it != std::end(cell.boundaries) && !selected; ++it)
+			selected = filter->Selected(it->layer, it->datatype);
+
+		for (auto it = std::begin(cell.paths); it != std::end(cell.paths) && !selected; ++it)
+			selected = filter->Selected(it->layer, it->datatype);
+
+		for (auto it = std::begin(cell.children); it != std::end(cell.children) && !selected; ++it)
+			selected = gds->m_cellSelected[*it];
+
+		gds->m_cellSelected[i] = selected;
+	}
+}
+
+static void IndexNames(Database* gds)
+{
+	// Build the name to cell index
+
+	gds->m_cellIndex.assign(gds->m_names.size(), GDS_NO_CELL);
+
+	for (size_t i = 0; i < gds->m_cells.size(); i++) {
+		// The first of duplicate cell names wins
+		if (gds->m_cellIndex[gds->m_cells[i].strname] == GDS_NO_CELL)
+			gds->m_cellIndex[gds->m_cells[i].strname] = uint32_t(i);
+	}
+}
+
+static void ResolveRefs(Database* gds)
+{
+	// Resolve the cell referenced by every SREF and AREF, so the hierarchy
+	// can be walked without name lookups.
+
+	for (auto it = std::begin(gds->m_cells); it != std::end(gds->m_cells); ++it) {
+		for (auto it2 = std::begin(it->srefs); it2 != std::end(it->srefs); ++it2) {
+			it2->cell = gds->m_cellIndex[it2->sname];
+		}
+		for (auto it2 = std::begin(it->arefs); it2 != std::end(it->arefs); ++it2) {
+			it2->cell = gds->m_cellIndex[it2->sname];
+		}
+	}
+
+	LinkCells(gds);
+}
+
+static void IndexCells(Database* gds)
+{
+	IndexNames(gds);
+	ResolveRefs(gds);
+
+	std::vector<uint32_t> order;
+
+	BottomUp(gds, order);
+	BoundCells(gds, order);
+	SelectCells(gds, order);
+}
+
+// Functions to query a window through the hierarchy
+
+// Cells with at most this many elements and references are scanned
+// instead of indexed
+static const size_t WINDOW_SCAN_SIZE = 16;
+
+static size_t CellItems(const Cell& cell)
+{
+	return cell.boundaries.size() + cell.paths.size() + cell.srefs.size() + cell.arefs.size();
+}
+
+static bool BoundItem(Database* gds, const Cell& cell, size_t id, Pair* box)
+{
+	// Bounding box of element or reference id of cell in the coordinates of
+	// the cell. Return false if it is empty.
+
+	size_t bcount = cell.boundaries.size(), pcount = cell.paths.size(), scount = cell.srefs.size();
+
+	box[0] = { INT_MAX, INT_MAX };
+	box[1] = { INT_MIN, INT_MIN };
+
+	if (id < bcount) {
+		const Bndry& it = cell.boundaries[id];
+
+		AddToBox(box, &cell.pairs[it.offset], it.count);
+	}
+	else if (id < bcount + pcount) {
+		const Path& it = cell.paths[id - bcount];
+
+		if (it.count == 0)
+			return false;
+
+		size_t out_size = 2 * size_t(it.count) + 1U;
+		Pair* tmp = GrowBuffer(ThreadScratch().path, out_size);
+
+		ExpandPath(tmp, &cell.pairs[it.offset], it.count, it.width, it.pathtype);
+		AddToBox(box, tmp, out_size);
+	}
+	else if (id < bcount + pcount + scount) {
+		const SRef& it = cell.srefs[id - bcount - pcount];
+
+		if (it.cell == GDS_NO_CELL)
+			throw std::runtime_error("SREF cell not found");
+
+		Transform tra = AccumulateTransform(Transform(), it.x, it.y, it.strans, it.mag, it.angle);
+		AddRefToBox(box, gds->m_cells[it.cell], tra);
+	}
+	else {
+		const Aref& it = cell.arefs[id - bcount - pcount - scount];
+
+		if (it.cell == GDS_NO_CELL)
+			throw std::runtime_error("AREF cell not found");
+
+		if (it.col == 0 || it.row == 0)
+			return false;
+
+		// The corner references cover all the others, as in BoundCell
+		int cols[2] = { 0, it.col - 1 };
+		int rows[2] = { 0, it.row - 1 };
+
+		for (int c = 0; c < 2; c++) {
+			for (int r = 0; r < 2; r++) {
+				Pair ref = ArefOrigin(&it, cols[c], rows[r]);
+				Transform tra = AccumulateTransform(Transform(), ref.x, ref.y, it.strans, it.mag, it.angle);
+				AddRefToBox(box, gds->m_cells[it.cell], tra);
+			}
+		}
+	}
+
+	return box[0].x <= box[1].x;
+}
+
+static const BoxTree* CellTree(Database* gds, uint32_t cell)
+{
+	// The tree over the items of a cell, built if needed
+
+	WindowIndex& index = *gds->m_windowIndex;
+	std::lock_guard<std::mutex> guard(index.lock);
+
+	if (index.trees.size() != gds->m_cells.size())
+		index.trees.resize(gds->m_cells.size());
+
+	std::unique_ptr<BoxTree>& tree = index.trees[cell];
+
+	if (!tree) {
+		const Cell& top = gds->m_cells[cell];
+		size_t count = CellItems(top);
+
+		tree.reset(new BoxTree());
+		tree->entries.reserve(count + count / 8);
+
+		for (size_t id = 0; id < count; id++) {
+			Pair box[2];
+
+			if (BoundItem(gds, top, id, box))
+				tree->Add(box, uint32_t(id));
+		}
+
+		tree->Pack();
+	}
+
+	return tree.get();
+}
+
+static void FindItems(Database* gds, WindowFrame& frame, const Pair* window)
+{
+	// The ids of the items of the cell of frame that may overlap window
+	// (padded) once transformed, in order
+
+	const Cell& top = gds->m_cells[frame.cell];
+	size_t count = CellItems(top);
+
+	frame.ids.clear();
+
+	if (count <= WINDOW_SCAN_SIZE) {
+		for (size_t id = 0; id < count; id++)
+			frame.ids.push_back(id);
+		return;
+	}
+
+	const Transform& tra = frame.tra;
+
+	CellTree(gds, frame.cell)->Search([&](const Pair* box) { return TestBoxOverlap(box, tra, window); }, frame.ids);
+
+	std::sort(frame.ids.begin(), frame.ids.end());
+}
+
+static void LinearPart(const Transform& tra, double x, double y, double& out_x, double& out_y)
+{
+	// The vector (x, y) transformed by tra without its translation
+
+	if (tra.kind != Transform::AFFINE) {
+		out_x = tra.m[0] * x + tra.m[1] * y;
+		out_y = tra.m[2] * x + tra.m[3] * y;
+		return;
+	}
+
+	double sign = tra.mirror ? -1.0 : 1.0;
+
+	out_x = tra.mag * (x * tra.cos_a - sign * y * tra.sin_a);
+	out_y = tra.mag * (x * tra.sin_a + sign * y * tra.cos_a);
+}
+
+static void FindArefRefs(Database* gds, WindowFrame& frame, const Pair* window)
+{
+	// The references of AREF frame.aref that may overlap window, by solving
+	// for the (col, row) range whose origins put the referenced cell inside
+	// it. The origins are linear in (col, row) but for rounding, which the
+	// margins cover; the references are tested one by one afterwards.
+
+	const Aref& it = gds->m_cells[frame.cell].arefs[frame.aref];
+	const Cell& ref_cell = gds->m_cells[it.cell];
+
+	frame.refs.clear();
+	frame.next_ref = 0;
+
+	if (it.col == 0 || it.row == 0 || ref_cell.bbox[0].x > ref_cell.bbox[1].x)
+		return;
+
+	int col_range[2] = { 0, it.col - 1 }, row_range[2] = { 0, it.row - 1 };
+
+	// The box of the referenced cell about its origin, in the window frame
+	Transform rot = frame.aref_tra;
+	Pair box[2];
+
+	rot.x = rot.y = 0;
+	TransformBox(box, ref_cell.bbox, rot);
+
+	// Origin of (0, 0) and the steps per column and row in the window frame
+	Pair start = ArefOrigin(&it, 0, 0);
+	Pair origin = TransformOffset(frame.tra, start.x, start.y);
+	double ux, uy, vx, vy;
+
+	LinearPart(frame.tra, (double(it.x2) - it.x1) / it.col, (double(it.y2) - it.y1) / it.col, ux, uy);
+	LinearPart(frame.tra, (double(it.x3) - it.x1) / it.row, (double(it.y3) - it.y1) / it.row, vx, vy);
+
+	double det = ux * vy - uy * vx;
+
+	if (det != 0.0) {
+		double margin = 2.0 + 2.0 * frame.tra.mag;
+		double qx[2] = { double(window[0].x) - box[1].x - margin - origin.x, double(window[2].x) - box[0].x + margin - origin.x };
+		double qy[2] = { double(window[0].y) - box[1].y - margin - origin.y, double(window[2].y) - box[0].y + margin - origin.y };
+		double c_min = INFINITY, c_max = -INFINITY, r_min = INFINITY, r_max = -INFINITY;
+
+		for (int i = 0; i < 2; i++) {
+			for (int j = 0; j < 2; j++) {
+				double c = (qx[i] * vy - qy[j] * vx) / det;
+				double r = (ux * qy[j] - uy * qx[i]) / det;
+
+				c_min = std::min(c_min, c);
+				c_max = std::max(c_max, c);
+				r_min = std::min(r_min, r);
+				r_max = std::max(r_max, r);
+			}
+		}
+
+		col_range[0] = int(std::max(double(col_range[0]), floor(c_min) - 1.0));
+		col_range[1] = int(std::min(double(col_range[1]), ceil(c_max) + 1.0));
+		row_range[0] = int(std::max(double(row_range[0]), floor(r_min) - 1.0));
+		row_range[1] = int(std::min(double(row_range[1]), ceil(r_max) + 1.0));
+	}
+
+	for (int c = col_range[0]; c <= col_range[1]; c++)
+		for (int r = row_range[0]; r <= row_range[1]; r++)
+			frame.refs.push_back(uint32_t(c) * it.row + uint32_t(r));
+}
+
+static void PushWindowFrame(std::vector<WindowFrame>& stack, Database* gds, uint32_t cell, const Transform& tra, const Pair* window)
+{
+	// Deeper than the number of cells means a cell references itself
+	if (stack.size() > gds->m_cells.size())
+		throw std::runtime_error("Recursive cell reference");
+
+	stack.emplace_back();
+	stack.back().cell = cell;
+	stack.back().tra = tra;
+
+	FindItems(gds, stack.back(), window);
+}
+
+static void QueryHierarchy(Database* gds, uint32_t top, const Pair* bbox, WindowSink& sink)
+{
+	// Walk the parts of the hierarchy overlapping the window bbox depth
+	// first, in the order of Resume. The items of a cell are looked up with
+	// a padded window and then tested exactly as Resume does.
+
+	Pair window[3];
+
+	window[0] = { int32_t(std::max(int64_t(INT_MIN), int64_t(bbox[0].x) - 4)), int32_t(std::max(int64_t(INT_MIN), int64_t(bbox[0].y) - 4)) };
+	window[2] = { int32_t(std::min(int64_t(INT_MAX), int64_t(bbox[2].x) + 4)), int32_t(std::min(int64_t(INT_MAX), int64_t(bbox[2].y) + 4)) };
+
+	std::vector<WindowFrame> stack;
+	std::vector<InstanceStep> path;
+
+	PushWindowFrame(stack, gds, top, Transform(), window);
+
+	while (!stack.empty()) {
+		WindowFrame& frame = stack.back();
+		const Cell& cell = gds->m_cells[frame.cell];
+
+		// References of the AREF being expanded
+		if (frame.next_ref < frame.refs.size()) {
+			const Aref& it = cell.arefs[frame.aref];
+			uint32_t ref = frame.refs[frame.next_ref++];
+
+			Pair origin = ArefOrigin(&it, int(ref / it.row), int(ref % it.row));
+			origin = TransformOffset(frame.tra, origin.x, origin.y);
+
+			Transform acc_tra = frame.aref_tra;
+
+			acc_tra.x = origin.x;
+			acc_tra.y = origin.y;
+
+			if (!TestBoxOverlap(gds->m_cells[it.cell].bbox, acc_tra, bbox))
+				continue;
+
+			path.push_back({ it.cell, uint32_t(frame.aref), ref, true });
+			sink.Instance(path.data(), path.size());
+
+			// frame is not valid after this
+			PushWindowFrame(stack, gds, it.cell, acc_tra, window);
+			continue;
+		}
+
+		if (frame.next == frame.ids.size()) {
+			stack.pop_back();
+
+			if (!path.empty())
+				path.pop_back();
+			continue;
+		}
+
+		size_t id = frame.ids[frame.next++];
+		size_t ecount = cell.boundaries.size() + cell.paths.size();
+
+		if (id < ecount) {
+			// BOUNDARY or PATH element
+			size_t size;
+			uint16_t layer, datatype;
+			Pair* out = ElementPoly(cell, id, frame.tra, gds->m_filter.get(), size, layer, datatype);
+
+			if (!out || !TestPolyOverlap(out, size, bbox))
+				continue;
+
+			if (gds->m_clip)
+				out = ClipPoly(out, size, bbox);
+
+			if (out)
+				sink.Add(path.data(), path.size(), out, size, layer, datatype);
+			continue;
+		}
+
+		id -= ecount;
+
+		if (id < cell.srefs.size()) {
+			const SRef& it = cell.srefs[id];
+
+			if (it.cell == GDS_NO_CELL)
+				throw std::runtime_error("SREF cell not found");
+
+			if (!gds->m_cellSelected[it.cell])
+				continue;
+
+			Transform acc_tra = AccumulateTransform(frame.tra, it.x, it.y, it.strans, it.mag, it.angle);
+
+			if (!TestBoxOverlap(gds->m_cells[it.cell].bbox, acc_tra, bbox))
+				continue;
+
+			path.push_back({ it.cell, uint32_t(id), 0, false });
+			sink.Instance(path.data(), path.size());
+
+			// frame is not valid after this
+			PushWindowFrame(stack, gds, it.cell, acc_tra, window);
+			continue;
+		}
+
+		// AREF: its references are taken from the next iterations on
+		const Aref& it = cell.arefs[id - cell.srefs.size()];
+
+		if (it.cell == GDS_NO_CELL)
+			throw std::runtime_error("AREF cell not found");
+
+		if (!gds->m_cellSelected[it.cell])
+			continue;
+
+		frame.aref = id - cell.srefs.size();
+		frame.aref_tra = AccumulateTransform(frame.tra, it.x1, it.y1, it.strans, it.mag, it.angle);
+
+		FindArefRefs(gds, frame, window);
+	}
+}
+
+// Functions to reload a changed file
+
+static void ReloadAll(Database* gds, unsigned threads)
+{
+	// Load the whole file again, dropping everything derived from it
+
+	gds->m_cells.clear();
+	gds->m_libnames.clear();
+	gds->m_fingerprints.clear();
+	gds->m_structBytes.clear();
+	gds->m_structOffsets.clear();
+
+	LoadFile(gds, gds->m_filePath.c_str(), false, threads);
+	IndexCells(gds);
+
+	gds->m_windowIndex = std::make_shared<WindowIndex>();
+
+	if (gds->m_cache)
+		gds->SetFlattenCache(gds->m_cache->max_bytes);
+}
+
+static void KeepCaches(Database* gds, const std::vector<uint32_t>& kept, const std::vector<uint8_t>& dirty, size_t old_count)
+{
+	// Move what was derived from the cells kept unchanged by a reload to
+	// their new index, kept[new] being the old one, and drop the rest
+
+	size_t count = gds->m_cells.size();
+	std::vector<uint32_t> moved(old_count, GDS_NO_CELL);
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (!dirty[i])
+			moved[kept[i]] = i;
+	}
+
+	std::vector<uint8_t> selected(count, 0);
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (!dirty[i] && kept[i] < gds->m_cellSelected.size())
+			selected[i] = gds->m_cellSelected[kept[i]];
+	}
+
+	gds->m_cellSelected.swap(selected);
+
+	{
+		WindowIndex& index = *gds->m_windowIndex;
+		std::lock_guard<std::mutex> guard(index.lock);
+		std::vector<std::unique_ptr<BoxTree>> trees(count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (!dirty[i] && kept[i] < index.trees.size())
+				trees[i] = std::move(index.trees[kept[i]]);
+		}
+
+		index.trees.swap(trees);
+	}
+
+	if (!gds->m_cache)
+		return;
+
+	FlattenCache& cache = *gds->m_cache;
+	std::lock_guard<std::mutex> guard(cache.lock);
+
+	std::vector<double> estimates(count, -1.0), polys(count, -1.0), inexact(count, -1.0);
+	std::vector<uint8_t> seen(count, 0);
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (!dirty[i]) {
+			estimates[i] = cache.estimates[kept[i]];
+			polys[i] = cache.polys[kept[i]];
+			inexact[i] = cache.inexact[kept[i]];
+			seen[i] = cache.seen[kept[i]];
+		}
+	}
+
+	cache.estimates.swap(estimates);
+	cache.polys.swap(polys);
+	cache.inexact.swap(inexact);
+	cache.seen.swap(seen);
+
+	// Renumber the cached cells in the same order of use
+	std::list<uint32_t> lru;
+	std::unordered_map<uint32_t, std::pair<std::shared_ptr<const PolyBuffer>, std::list<uint32_t>::iterator>> cells;
+
+	for (uint32_t cell : cache.lru) {
+		auto it = cache.cells.find(cell);
+
+		if (moved[cell] == GDS_NO_CELL) {
+			cache.bytes -= BufferBytes(*it->second.first);
+			continue;
+		}
+
+		lru.push_back(moved[cell]);
+		cells[moved[cell]] = { it->second.first, std::prev(lru.end()) };
+	}
+
+	cache.lru.swap(lru);
+	cache.cells.swap(cells);
+}
+
+static void RasterizeUnion(RasterSink& sink, Rasterizer& raster)
+{
+	// Rasterize the union of the polygons of sink. Only the groups of
+	// polygons with overlapping bounding boxes are merged, each on its own,
+	// as merging costs far more than rasterizing and most polygons overlap
+	// few others.
+
+	size_t count = sink.offsets.size() - 1;
+	auto poly = [&](size_t i) { return &sink.pairs[sink.offsets[i]]; };
+	auto size = [&](size_t i) { return sink.offsets[i + 1] - sink.offsets[i]; };
+
+	std::vector<Pair> boxes(2 * count);
+	std::vector<uint32_t> parent(count);
+	Pair extent[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
+
+	for (uint32_t i = 0; i < count; i++) {
+		Pair* box = &boxes[2 * i];
+
+		box[0] = { INT_MAX, INT_MAX };
+		box[1] = { INT_MIN, INT_MIN };
+		AddToBox(box, poly(i), size(i));
+		AddToBox(extent, box, 2);
+		parent[i] = i;
+	}
+
+	auto find = [&](uint32_t i) {
+		while (parent[i] != i)
+			i = parent[i] = parent[parent[i]];
+		return i;
+	};
+
+	// Put the boxes in a grid of about one cell per polygon and compare the
+	// boxes in every cell, sorted by x. Boxes that only touch do not overlap
+	// in area, and those without area cannot overlap at all.
+	size_t side = std::min(size_t(1024), size_t(std::sqrt(double(count))) + 1);
+	double cw = (double(extent[1].x) - extent[0].x) / side + 1.0;
+	double ch = (double(extent[1].y) - extent[0].y) / side + 1.0;
+
+	auto cells = [&](const Pair* box, size_t* range) {
+		range[0] = size_t((double(box[0].x) - extent[0].x) / cw);
+		range[1] = size_t((double(box[1].x) - 1 - extent[0].x) / cw);
+		range[2] = size_t((double(box[0].y) - extent[0].y) / ch);
+		range[3] = size_t((double(box[1].y) - 1 - extent[0].y) / ch);
+	};
+
+	std::vector<uint32_t> start(side * side + 1, 0), ids;
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (uint32_t i = 0; i < count; i++) {
+			const Pair* box = &boxes[2 * i];
+			size_t range[4];
+
+			if (box[0].x >= box[1].x || box[0].y >= box[1].y)
+				continue;
+
+			cells(box, range);
+
+			for (size_t y = range[2]; y <= range[3]; y++) {
+				for (size_t x = range[0]; x <= range[1]; x++) {
+					if (pass == 0)
+						start[y * side + x + 1]++;
+					else
+						ids[start[y * side + x]++] = i;
+				}
+			}
+		}
+
+		if (pass == 0) {
+			for (size_t c = 0; c < side * side; c++)
+				start[c + 1] += start[c];
+
+			ids.resize(start.back());
+		}
+	}
+
+	// Filling moved the start of every cell to that of the next
+	std::copy_backward(start.begin(), start.end() - 1, start.end());
+	start[0] = 0;
+
+	for (size_t c = 0; c < side * side; c++) {
+		auto first = ids.begin() + start[c], last = ids.begin() + start[c + 1];
+
+		std::sort(first, last, [&](uint32_t a, uint32_t b) { return boxes[2 * a].x < boxes[2 * b].x; });
+
+		for (auto a = first; a != last; ++a) {
+			const Pair* box = &boxes[2 * *a];
+
+			for (auto b = a + 1; b != last && boxes[2 * *b].x < box[1].x; ++b) {
+				const Pair* other = &boxes[2 * *b];
+
+				if (other[0].y < box[1].y && box[0].y < other[1].y)
+					parent[find(*b)] = find(*a);
+			}
+		}
+	}
+
+	// Polygons by group; a group of one is rasterized as is
+	std::vector<uint32_t> first(count, UINT32_MAX), next(count, UINT32_MAX);
+
+	for (uint32_t i = count; i-- > 0;) {
+		uint32_t root = find(i);
+
+		next[i] = first[root];
+		first[root] = i;
+	}
+
+	std::vector<Polygon> group, merged;
+
+	for (uint32_t root = 0; root < count; root++) {
+		if (first[root] == UINT32_MAX)
+			continue;
+
+		if (next[first[root]] == UINT32_MAX) {
+			raster.AddPoly(poly(root), size(root));
+			continue;
+		}
+
+		group.clear();
+		merged.clear();
+
+		for (uint32_t i = first[root]; i != UINT32_MAX; i = next[i])
+			group.push_back(Polygon(poly(i), size(i), 0));
+
+		Merge(group, merged);
+
+		for (const Polygon& poly : merged)
+			raster.AddPoly(poly.m_pairs.data(), poly.m_pairs.size());
+	}
+}
+
+// Pixels per side of the tiles an image is rasterized in
+static const unsigned RASTER_TILE = 256;
+
+// Member functions
+
+Database::Database(const wchar_t* file, bool map_file, unsigned threads, const LayerFilter* filter)
+{
+	m_filePath = std::wstring(file);
+
+	if (filter)
+		m_filter = std::make_shared<LayerFilter>(*filter);
+
+	m_loadFilter = m_filter;
+
+	LoadFile(this, file, map_file, threads);
+	IndexCells(this);
+
+	m_windowIndex = std::make_shared<WindowIndex>();
+}
+
+void Database::Reload(const wchar_t* file, unsigned threads)
+{
+	if (file)
+		m_filePath = std::wstring(file);
+
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	MappedFile mapped;
+
+	if (!mapped.Open(m_filePath.c_str())) {
+		ReloadAll(this, threads);
+		return;
+	}
+
+	Parser state{};
+	std::vector<StructRange> ranges;
+	std::vector<uint64_t> fingerprints;
+
+	state.gds = this;
+	state.cells = &m_cells;
+
+	m_libnames.clear();
+
+	ScanLibrary(state, mapped.data, mapped.size, ranges);
+	FingerprintRanges(mapped.data, ranges, threads, fingerprints);
+
+	// Keep the cells of the structures with the same bytes as before and
+	// decode the others; the fingerprints only find the candidates
+	std::unordered_multimap<uint64_t, uint32_t> before;
+
+	if (m_fingerprints.size() == m_cells.size() && m_structOffsets.size() == m_cells.size() + 1) {
+		for (uint32_t i = 0; i < m_cells.size(); i++)
+			before.emplace(m_fingerprints[i], i);
+	}
+
+	std::vector<uint32_t> kept(ranges.size(), GDS_NO_CELL); // Old index of every cell kept
+	std::vector<StructRange> changed;
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		size_t begin = ranges[i].begin + BufReadShort(mapped.data + ranges[i].begin), size = ranges[i].end - begin;
+		auto match = before.equal_range(fingerprints[i]);
+
+		for (auto it = match.first; it != match.second; ++it) {
+			uint32_t old = it->second;
+			size_t offset = m_structOffsets[old];
+
+			if (m_structOffsets[old + 1] - offset == size && !memcmp(m_structBytes.data() + offset, mapped.data + begin, size)) {
+				kept[i] = old;
+				before.erase(it);
+				break;
+			}
+		}
 
-			if (curElem == PATH) {
-				curPath.width = uint32_t(buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]);
-			}
+		if (kept[i] == GDS_NO_CELL)
+			changed.push_back(ranges[i]);
+	}
 
-			break;
-		case GDS_DATATYPE:
-			break;
-		case GDS_TEXTNODE:
-			break;
-		case GDS_TEXTTYPE:
-			break;
-		case GDS_PRESENTATION:
-			break;
-		case GDS_STRING:
-			break;
-		case GDS_REFLIBS:
-			break;
-		case GDS_FONTS:
-			break;
-		case GDS_ATTRTABLE:
-			break;
-		case GDS_ELFLAGS:
-			break;
-		case GDS_PROPATTR:
-			break;
-		case GDS_PROPVALUE:
-			break;
-		case GDS_BOXTYPE:
-			break;
-		case GDS_PLEX:
-			break;
-		case GDS_BGNEXTN:
-			break;
-		case GDS_ENDEXTN:
-			break;
-		case GDS_FORMAT:
-			break;
-		default:
-			throw std::runtime_error("Unknown GDS record type");
+	std::vector<Cell> parsed, cells(ranges.size());
+
+	ParseStructures(this, mapped.data, changed, threads, parsed);
+
+	for (size_t i = 0, next = 0; i < ranges.size(); i++)
+		cells[i] = kept[i] != GDS_NO_CELL ? std::move(m_cells[kept[i]]) : std::move(parsed[next++]);
+
+	size_t old_count = m_cells.size();
+
+	m_cells.swap(cells);
+	m_fingerprints.swap(fingerprints);
+	CopyRanges(mapped.data, ranges, m_structBytes, m_structOffsets);
+
+	IndexNames(this);
+
+	// A kept cell changes too if a name it references now is another cell,
+	// and so do the cells referencing a changed cell
+	std::vector<uint8_t> dirty(m_cells.size(), 0);
+	std::vector<uint32_t> stack;
+
+	auto moved = [&](uint32_t sname, uint32_t cell) {
+		uint32_t now = m_cellIndex[sname];
+
+		return now == GDS_NO_CELL ? cell != GDS_NO_CELL : cell == GDS_NO_CELL || kept[now] != cell;
+	};
+
+	for (uint32_t i = 0; i < m_cells.size(); i++) {
+		const Cell& cell = m_cells[i];
+		bool changes = kept[i] == GDS_NO_CELL;
+
+		for (auto it = std::begin(cell.srefs); it != std::end(cell.srefs) && !changes; ++it)
+			changes = moved(it->sname, it->cell);
+		for (auto it = std::begin(cell.arefs); it != std::end(cell.arefs) && !changes; ++it)
+			changes = moved(it->sname, it->cell);
+
+		if (changes) {
+			dirty[i] = 1;
+			stack.push_back(i);
+		}
+	}
+
+	ResolveRefs(this);
+
+	while (!stack.empty()) {
+		uint32_t cell = stack.back();
+
+		stack.pop_back();
+
+		for (uint32_t parent : m_cells[cell].parents) {
+			if (!dirty[parent]) {
+				dirty[parent] = 1;
+				stack.push_back(parent);
+			}
 		}
+	}
 
-		delete[] buf;
+	KeepCaches(this, kept, dirty, old_count);
 
-		if (readEndlib)
-			break;
+	// Bound the changed cells again, bottom up
+	std::vector<uint32_t> order, redo;
+
+	BottomUp(this, order);
+
+	for (uint32_t cell : order) {
+		if (dirty[cell])
+			redo.push_back(cell);
 	}
 
-	if (p_file)
-		fclose(p_file);
+	BoundCells(this, redo);
+	SelectCells(this, redo);
+
+	if (m_cache) {
+		for (uint32_t i = 0; i < m_cells.size(); i++) {
+			EstimateBytes(this, i, m_cache->estimates);
+			CountPolys(this, i, m_cache->polys);
+			CountInexact(this, i, m_cache->inexact);
+		}
+	}
 }
 
 void Database::AllCells(std::vector<std::wstring>& sset)
 {
-	for (auto it : m_cells)
+	for (const auto& it : m_cells)
 	{
-		sset.push_back(std::wstring(it.wstrname));
+		sset.push_back(m_names[it.strname]);
 	}
 }
 
-void Database::CollapseCell(const wchar_t* cell, const double* bounds, uint64_t max_polys, const wchar_t* dest, std::vector<Polygon>* pset)
+static Cell* StartCollapse(Database* gds, const wchar_t* cell, const double* bounds, Recdata& rdata)
 {
-	Recdata rdata{};
-	Transform trans{};
+	// Set up rdata for flattening cell within bounds and return the cell
 
-	rdata.pset = pset;
-	rdata.max_polys = max_polys;
-	rdata.gds = this;
+	double uu = gds->m_uu_per_dbunit;
+
+	rdata.gds = gds;
+	rdata.cache = gds->m_cache.get();
+	rdata.clip = gds->m_clip;
 
 	if (!cell)
 		throw std::runtime_error("No input cell provided");
 
-	if (dest)
-	{
-		// 24 bytes needed for GDS_BGNLIB.
-		uint8_t access[24] = { 0 };
-
-		_wfopen_s(&rdata.poutfile, dest, L"wb");
-		if (!rdata.poutfile)
-			throw std::runtime_error("Failure creating file for writing");
-
-		// Write starting records to output GDS file.
-		FileAppendShort(rdata.poutfile, GDS_HEADER, 600);
-		FileAppendBytes(rdata.poutfile, GDS_BGNLIB, access, 24);
-		FileAppendString(rdata.poutfile, GDS_LIBNAME, "");
-		FileAppendBytes(rdata.poutfile, GDS_UNITS, (uint8_t*)m_units, 16);
-		FileAppendBytes(rdata.poutfile, GDS_BGNSTR, access, 24);
-		FileAppendString(rdata.poutfile, GDS_STRNAME, "TOP");
-	}
-
 	// Create the bounding box
 	if (bounds)
 	{
@@ -928,89 +3470,520 @@ void Database::CollapseCell(const wchar_t* cell, const double* bounds, uint64_t
 			throw std::runtime_error("Incorrect bounding box");
 		}
 
-		rdata.bbox[0] = { (int)(bounds[0] / m_uu_per_dbunit), (int)(bounds[1] / m_uu_per_dbunit) };
-		rdata.bbox[1] = { (int)(bounds[0] / m_uu_per_dbunit), (int)(bounds[3] / m_uu_per_dbunit) };
-		rdata.bbox[2] = { (int)(bounds[2] / m_uu_per_dbunit), (int)(bounds[3] / m_uu_per_dbunit) };
-		rdata.bbox[3] = { (int)(bounds[2] / m_uu_per_dbunit), (int)(bounds[1] / m_uu_per_dbunit) };
+		rdata.bbox[0] = { (int)(bounds[0] / uu), (int)(bounds[1] / uu) };
+		rdata.bbox[1] = { (int)(bounds[0] / uu), (int)(bounds[3] / uu) };
+		rdata.bbox[2] = { (int)(bounds[2] / uu), (int)(bounds[3] / uu) };
+		rdata.bbox[3] = { (int)(bounds[2] / uu), (int)(bounds[1] / uu) };
 		rdata.bbox[4] = rdata.bbox[0];
 	}
 
-	// start the recursion
-
-	Cell* top = FindCell(rdata.gds, cell);
+	Cell* top = FindCell(gds, cell);
 
 	if (!top)
 		throw std::runtime_error("Cell not found");
 
-	Recurse(*top, trans, rdata);
+	return top;
+}
+
+static void Collapse(Database* gds, const wchar_t* cell, const double* bounds, unsigned threads, Recdata& rdata)
+{
+	Transform trans{};
+	Cell* top = StartCollapse(gds, cell, bounds, rdata);
+
+	// start the recursion
+
+	if (threads > 1)
+		CollapseParallel(*top, trans, rdata, threads);
+	else
+		Recurse(*top, trans, rdata);
+}
+
+void Database::CollapseCell(const wchar_t* cell, const double* bounds, uint64_t max_polys, const wchar_t* dest, std::vector<Polygon>* pset, unsigned threads)
+{
+	Recdata rdata{};
+
+	rdata.pset = pset;
+	rdata.max_polys = max_polys;
+
+	std::unique_ptr<Writer> writer;
+
+	if (threads == 0)
+		threads = HardwareThreads();
 
-	// write the tail headers to the outfile
 	if (dest)
 	{
-		FileAppendRecord(rdata.poutfile, GDS_ENDSTR);
-		FileAppendRecord(rdata.poutfile, GDS_ENDLIB);
+		// Flush in the background when other threads are in use anyway
+		writer.reset(new Writer(dest, threads > 1));
+		rdata.pwriter = writer.get();
+
+		// Write starting records to output GDS file.
+		writer->BeginLibrary(m_units);
+		writer->BeginStructure("TOP");
 	}
 
-	if (rdata.poutfile)
+	Collapse(this, cell, bounds, threads, rdata);
+
+	// write the tail headers to the outfile
+	if (writer)
 	{
-		fclose(rdata.poutfile);
+		writer->EndStructure();
+		writer->EndLibrary();
+		writer->Close();
 	}
 }
 
-void Database::TopCells(std::vector<std::wstring>& sset)
+void Database::CollapseCell(const wchar_t* cell, const double* bounds, uint64_t max_polys, PolySink& sink, unsigned threads)
 {
-	for (auto it = m_cells.begin(); it != m_cells.end(); ++it)
-	{
-		int is_referenced = 0;
-		for (auto it2 = m_cells.begin(); it2 != m_cells.end(); ++it2) {
+	Recdata rdata{};
 
-			for (auto it3 = it2->arefs.begin(); it3 != it2->arefs.end(); ++it3) {
-				if (wcscmp(it3->sname, it->wstrname) == 0) {
-					is_referenced = 1;
-					break;
-				}
-			}
-			for (auto it3 = it2->srefs.begin(); it3 != it2->srefs.end(); ++it3) {
-				if (wcscmp(it3->sname, it->wstrname) == 0) {
-					is_referenced = 1;
-					break;
-				}
+	rdata.psink = &sink;
+	rdata.max_polys = max_polys;
+
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	Collapse(this, cell, bounds, threads, rdata);
+}
+
+void Database::CollapseTiles(const wchar_t* cell, unsigned cols, unsigned rows, uint64_t max_polys, const wchar_t* dest, unsigned threads)
+{
+	Recdata rdata{};
+	Cell* top = StartCollapse(this, cell, nullptr, rdata);
+
+	if (cols == 0 || rows == 0)
+		throw std::runtime_error("Incorrect tile grid");
+
+	if (!dest)
+		throw std::runtime_error("No output file provided");
+
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	// The tile edges over the cell extent in database units
+	Pair box[2] = { top->bbox[0], top->bbox[1] };
+
+	if (box[0].x > box[1].x)
+		box[0] = box[1] = { 0, 0 };
+
+	auto edge = [](int32_t lo, int32_t hi, unsigned i, unsigned n) {
+		return int32_t(lo + (int64_t(hi) - lo) * i / n);
+	};
+
+	// Every tile is flattened on its own, within its bounds, to its own file
+	RunTasks(size_t(cols) * rows, threads, [&](size_t k) {
+		unsigned col = unsigned(k % cols), row = unsigned(k / cols);
+		Recdata local = rdata;
+
+		local.usebbox = true;
+		local.max_polys = max_polys;
+		local.bbox[0] = { edge(box[0].x, box[1].x, col, cols), edge(box[0].y, box[1].y, row, rows) };
+		local.bbox[2] = { edge(box[0].x, box[1].x, col + 1, cols), edge(box[0].y, box[1].y, row + 1, rows) };
+		local.bbox[1] = { local.bbox[0].x, local.bbox[2].y };
+		local.bbox[3] = { local.bbox[2].x, local.bbox[0].y };
+		local.bbox[4] = local.bbox[0];
+
+		std::wstring file = std::wstring(dest) + L"_" + std::to_wstring(col) + L"_" + std::to_wstring(row) + L".gds";
+		Writer writer(file.c_str());
+
+		local.pwriter = &writer;
+
+		writer.BeginLibrary(m_units);
+		writer.BeginStructure("TOP");
+
+		Recurse(*top, Transform(), local);
+
+		writer.EndStructure();
+		writer.EndLibrary();
+		writer.Close();
+	});
+}
+
+void RasterSink::Add(const InstanceStep*, size_t, const Pair* pairs, size_t size, uint16_t layer, uint16_t datatype)
+{
+	if (layers && !layers->Selected(layer, datatype))
+		return;
+
+	Pair* p = GrowBuffer(buf, size);
+
+	std::copy(pairs, pairs + size, p);
+	p = ClipPoly(p, size, bbox);
+
+	if (p) {
+		this->pairs.insert(this->pairs.end(), p, p + size);
+		offsets.push_back(this->pairs.size());
+	}
+}
+
+void Database::CollapseDensity(const wchar_t* cell, const double* bounds, double tile_w, double tile_h, DensityMap& map, unsigned threads)
+{
+	Recdata rdata{};
+	Cell* top = StartCollapse(this, cell, bounds, rdata);
+
+	if (!(tile_w > 0.0 && tile_h > 0.0))
+		throw std::runtime_error("Incorrect tile size");
+
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	// The extent in database units: bounds or else the cell extent
+	Pair box[2] = { top->bbox[0], top->bbox[1] };
+
+	if (rdata.usebbox) {
+		box[0] = rdata.bbox[0];
+		box[1] = rdata.bbox[2];
+	}
+	else if (box[0].x > box[1].x) {
+		box[0] = box[1] = { 0, 0 };
+	}
+
+	double uu = m_uu_per_dbunit;
+	double tw = tile_w / uu, th = tile_h / uu;
+	std::unique_ptr<DensityGrid> grid(new DensityGrid());
+
+	grid->cols = unsigned(std::max(1.0, std::ceil((double(box[1].x) - box[0].x) / tw)));
+	grid->rows = unsigned(std::max(1.0, std::ceil((double(box[1].y) - box[0].y) / th)));
+
+	for (unsigned i = 0; i <= grid->cols; i++)
+		grid->xs.push_back(TileEdge(box[0].x, box[1].x, tw, i));
+	for (unsigned i = 0; i <= grid->rows; i++)
+		grid->ys.push_back(TileEdge(box[0].y, box[1].y, th, i));
+
+	map.x0 = box[0].x * uu;
+	map.y0 = box[0].y * uu;
+	map.tile_w = tile_w;
+	map.tile_h = tile_h;
+	map.cols = grid->cols;
+	map.rows = grid->rows;
+	map.layers.clear();
+
+	// The cell is flattened once, in parallel tasks that cut the polygons
+	// to the tiles themselves. A task takes the polygons collected so far
+	// by a finished one, so there are as many of them as threads.
+	std::vector<FlattenTask> tasks;
+	std::vector<std::unique_ptr<DensityPart>> parts;
+	std::mutex lock;
+
+	rdata.max_polys = UINT64_MAX;
+	rdata.clip = false;
+
+	if (threads > 1)
+		PlanTasks(*top, Transform(), rdata, threads, tasks);
+	else
+		tasks.push_back({ top, Transform(), false, 0.0 });
+
+	RunTasks(tasks.size(), threads, [&](size_t k) {
+		std::unique_ptr<DensityPart> part;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (!parts.empty()) {
+				part = std::move(parts.back());
+				parts.pop_back();
 			}
+		}
 
-			// break if the cell is referenced
-			if (is_referenced) break;
+		if (!part) {
+			part.reset(new DensityPart());
+			part->grid = grid.get();
 		}
 
-		if (!is_referenced) {
-			sset.push_back(it->wstrname);
+		Recdata local = rdata;
+
+		local.density = part.get();
+
+		if (tasks[k].elements_only)
+			RecurseElements(*tasks[k].cell, tasks[k].tra, local);
+		else
+			RecurseRef(uint32_t(tasks[k].cell - m_cells.data()), tasks[k].tra, local);
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		parts.push_back(std::move(part));
+	});
+
+	for (auto& part : parts)
+		FlushDensity(*part);
+
+	// The covered part of the tiles
+	std::vector<std::pair<uint64_t, DensityTile*>> tiles;
+
+	for (auto& stripe : grid->tiles) {
+		for (auto& it : stripe)
+			tiles.push_back({ it.first, &it.second });
+	}
+
+	std::vector<double> areas(tiles.size());
+
+	RunTasks(tiles.size(), threads, [&](size_t k) {
+		uint64_t key = tiles[k].first;
+		DensityTile& tile = *tiles[k].second;
+		unsigned col = unsigned((key >> 16) % grid->cols), row = unsigned((key >> 16) / grid->cols);
+
+		double size = (double(grid->xs[col + 1]) - grid->xs[col]) * (double(grid->ys[row + 1]) - grid->ys[row]);
+
+		areas[k] = tile.full ? 1.0 : TileArea(tile, uint16_t(key & 0xFFFF)) / size;
+		tile = DensityTile();
+	});
+
+	size_t count = size_t(map.cols) * map.rows;
+
+	for (size_t k = 0; k < tiles.size(); k++) {
+		std::vector<double>& density = map.layers[uint16_t(tiles[k].first & 0xFFFF)];
+
+		if (density.empty())
+			density.assign(count, 0.0);
+
+		density[size_t(tiles[k].first >> 16)] = areas[k];
+	}
+}
+
+void Database::Rasterize(const wchar_t* cell, const double* bounds, unsigned width, unsigned height, const LayerFilter* layers, bool antialias, RasterImage& image, unsigned threads)
+{
+	Recdata rdata{};
+	Cell* top = StartCollapse(this, cell, bounds, rdata);
+
+	if (width == 0 || height == 0)
+		throw std::runtime_error("Incorrect image size");
+
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	// The window in database units: bounds or else the cell extent
+	double uu = m_uu_per_dbunit;
+	double box[4] = { 0.0, 0.0, 1.0, 1.0 };
+
+	if (bounds) {
+		for (int i = 0; i < 4; i++)
+			box[i] = bounds[i] / uu;
+	}
+	else if (top->bbox[0].x <= top->bbox[1].x) {
+		box[0] = top->bbox[0].x;
+		box[1] = top->bbox[0].y;
+		box[2] = top->bbox[1].x;
+		box[3] = top->bbox[1].y;
+	}
+
+	double sx = (box[2] - box[0]) / width, sy = (box[3] - box[1]) / height;
+
+	image.width = width;
+	image.height = height;
+	image.pixels.assign(size_t(width) * height, 0);
+
+	// Every tile looks up its polygons through the window index, as
+	// QueryWindow does, and is rasterized on its own. The polygons are
+	// merged first, as overlapping ones would add up in the coverage.
+	uint32_t topIndex = uint32_t(top - m_cells.data());
+	unsigned cols = (width + RASTER_TILE - 1) / RASTER_TILE, rows = (height + RASTER_TILE - 1) / RASTER_TILE;
+
+	RunTasks(size_t(cols) * rows, threads, [&](size_t k) {
+		unsigned col = unsigned(k % cols) * RASTER_TILE, row = unsigned(k / cols) * RASTER_TILE;
+		unsigned w = std::min(RASTER_TILE, width - col), h = std::min(RASTER_TILE, height - row);
+		double x0 = box[0] + col * sx, y0 = box[1] + row * sy;
+
+		Rasterizer raster(w, h, x0, y0, sx, sy);
+		RasterSink sink;
+
+		sink.layers = layers;
+		sink.bbox[0] = { int32_t(std::floor(x0)), int32_t(std::floor(y0)) };
+		sink.bbox[2] = { int32_t(std::ceil(x0 + w * sx)), int32_t(std::ceil(y0 + h * sy)) };
+
+		QueryHierarchy(this, topIndex, sink.bbox, sink);
+		RasterizeUnion(sink, raster);
+
+		raster.Resolve(image, col, row, antialias);
+	});
+}
+
+void Database::QueryWindow(const wchar_t* cell, const double* bounds, WindowSink& sink)
+{
+	Recdata rdata{};
+	Cell* top = StartCollapse(this, cell, bounds, rdata);
+
+	// Without bounds the window is everything
+	if (!rdata.usebbox) {
+		rdata.bbox[0] = { INT_MIN, INT_MIN };
+		rdata.bbox[2] = { INT_MAX, INT_MAX };
+	}
+
+	QueryHierarchy(this, uint32_t(top - m_cells.data()), rdata.bbox, sink);
+}
+
+void Database::SetLayerFilter(const LayerFilter* filter)
+{
+	if (filter)
+		m_filter = std::make_shared<LayerFilter>(*filter);
+	else
+		m_filter.reset();
+
+	std::vector<uint32_t> order;
+
+	BottomUp(this, order);
+	SelectCells(this, order);
+
+	// The cached polygons were flattened with the previous filter
+	if (m_cache)
+		SetFlattenCache(m_cache->max_bytes);
+}
+
+void Database::SetClipToBounds(bool clip)
+{
+	m_clip = clip;
+}
+
+void Database::SetFlattenCache(size_t max_bytes)
+{
+	if (max_bytes == 0) {
+		m_cache.reset();
+		return;
+	}
+
+	m_cache = std::make_shared<FlattenCache>();
+	m_cache->max_bytes = max_bytes;
+	m_cache->estimates.assign(m_cells.size(), -1.0);
+	m_cache->polys.assign(m_cells.size(), -1.0);
+	m_cache->inexact.assign(m_cells.size(), -1.0);
+	m_cache->seen.assign(m_cells.size(), 0);
+
+	for (uint32_t i = 0; i < m_cells.size(); i++) {
+		EstimateBytes(this, i, m_cache->estimates);
+		CountPolys(this, i, m_cache->polys);
+		CountInexact(this, i, m_cache->inexact);
+	}
+}
+
+FlattenIterator::FlattenIterator(Database& gds, const wchar_t* cell, const double* bounds)
+	: m_state(new FlattenState())
+{
+	Cell* top = StartCollapse(&gds, cell, bounds, m_state->data);
+
+	m_state->stack.resize(1);
+	m_state->stack[0].cell = top;
+}
+
+FlattenIterator::~FlattenIterator() = default;
+
+bool FlattenIterator::Next(uint64_t max_polys, PolySink& sink)
+{
+	FlattenState& state = *m_state;
+
+	if (max_polys == 0)
+		return !state.stack.empty();
+
+	state.data.psink = &sink;
+	state.data.pcount = 0;
+	state.data.max_polys = max_polys;
+
+	Resume(state.stack, state.data);
+
+	state.data.psink = nullptr;
+
+	return !state.stack.empty();
+}
+
+void Database::TopCells(std::vector<std::wstring>& sset)
+{
+	for (auto it = m_cells.begin(); it != m_cells.end(); ++it)
+	{
+		if (it->parents.empty()) {
+			sset.push_back(m_names[it->strname]);
 		}
 	}
 }
 
+void Database::ChildCells(const wchar_t* cell, std::vector<std::wstring>& sset)
+{
+	Cell* str = FindCell(this, cell);
+
+	if (!str)
+		throw std::runtime_error("Cell not found");
+
+	for (auto it = str->children.begin(); it != str->children.end(); ++it)
+	{
+		sset.push_back(m_names[m_cells[*it].strname]);
+	}
+}
+
+void Database::ParentCells(const wchar_t* cell, std::vector<std::wstring>& sset)
+{
+	Cell* str = FindCell(this, cell);
+
+	if (!str)
+		throw std::runtime_error("Cell not found");
+
+	for (auto it = str->parents.begin(); it != str->parents.end(); ++it)
+	{
+		sset.push_back(m_names[m_cells[*it].strname]);
+	}
+}
+
 // Stand-alone helper
 
-bool GDS::PointInPoly(Pair* poly, int n, Pair p)
+void LayerFilter::Add(uint16_t layer)
+{
+	m_layers[layer] = ALL;
+}
+
+void LayerFilter::Add(uint16_t layer, uint16_t datatype)
+{
+	if (m_layers[layer] == ALL)
+		return;
+
+	m_layers[layer] = SOME;
+	m_datatypes.insert((uint32_t(layer) << 16) | datatype);
+}
+
+bool GDS::PointInPoly(const Pair* poly, int n, Pair p)
 {
 	// Evaluate if test point P is inside the polygon @poly.
 	// Returns true if yes and false if no
 
-	int count, i;
+	uint8_t inside = 0;
 
-	// counts the segment crossed by a vertical line downwards from test point P
-	count = 0;
-	for (i = 0; i < n - 1; i++) {
+	if (n > 0)
+		InsidePairs(poly, size_t(n), &p, 1, &inside);
 
-		// Check if segment i will cross a vertical line through the test point
-		if (((poly[i].x <= p.x) && (poly[i + 1].x > p.x)) || ((poly[i].x > p.x) && (poly[i + 1].x <= p.x))) {
+	return inside != 0;
+}
 
-			// add count if it crosses
-			if (p.y < poly[i].y + ((p.x - poly[i].x) * (poly[i + 1].y - poly[i].y)) / (poly[i + 1].x - poly[i].x)) {
-				count++;
-			}
-		}
+void GDS::PointsInPoly(const Pair* poly, int n, const Pair* points, size_t count, uint8_t* inside)
+{
+	// Points outside the bounding box of the polygon are out without testing
+	// the edges; the others are gathered and tested in one batch, in order of
+	// x so that the kernel can skip the edges far from a block of points.
+
+	std::fill(inside, inside + count, uint8_t(0));
+
+	if (n <= 0)
+		return;
+
+	Pair box[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
+	BoundPairs(box, poly, size_t(n));
+
+	std::vector<size_t> index;
+
+	for (size_t k = 0; k < count; k++) {
+		const Pair& p = points[k];
+
+		if (p.x >= box[0].x && p.x <= box[1].x && p.y >= box[0].y && p.y <= box[1].y)
+			index.push_back(k);
 	}
 
-	// if the coint is off the point is outside the polygon
-	return (bool(count % 2));
+	if (index.empty())
+		return;
+
+	// Sorting only pays off for polygons with many edges
+	if (n > 32)
+		std::sort(index.begin(), index.end(), [&](size_t a, size_t b) { return points[a].x < points[b].x; });
+
+	std::vector<Pair> candidates(index.size());
+	for (size_t k = 0; k < index.size(); k++)
+		candidates[k] = points[index[k]];
+
+	std::vector<uint8_t> result(index.size());
+	InsidePairs(poly, size_t(n), candidates.data(), candidates.size(), result.data());
+
+	for (size_t k = 0; k < index.size(); k++)
+		inside[index[k]] = result[k];
 }
 
@@ -9,23 +9,30 @@
 #pragma once
 
 #include "Polygon.h"
+#include "Raster.h"
 
+#include <climits>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-#define GDS_MAX_STR_NAME (32)
+#define GDS_NO_CELL (0xFFFFFFFF)
 
 namespace GDS
 {
+	// The vertices of the BOUNDARY and PATH elements are stored in the
+	// Cell::pairs arena; an element refers to 'count' pairs from 'offset'.
+
 	struct Bndry {
-		uint16_t layer = 0xFFFF;
-		std::vector<Pair> pairs;
+		uint32_t offset = 0, count = 0;
+		uint16_t layer = 0xFFFF, datatype = 0;
 	};
 
 	struct Path {
-		uint16_t layer = 0xFFFF;
-
-		std::vector<Pair> pairs;
+		uint32_t offset = 0, count = 0;
+		uint16_t layer = 0xFFFF, datatype = 0;
 
 		uint16_t pathtype;
 		uint32_t width;
@@ -34,7 +41,8 @@ namespace GDS
 	struct SRef {
 		int32_t x, y;
 
-		wchar_t sname[GDS_MAX_STR_NAME + 1];
+		uint32_t sname = 0; // Index in Database::m_names
+		uint32_t cell = GDS_NO_CELL; // Index of sname in Database::m_cells
 
 		uint16_t strans;
 		double mag = 1.0, angle;
@@ -43,7 +51,8 @@ namespace GDS
 	struct Aref {
 		int32_t x1, y1, x2, y2, x3, y3;
 
-		wchar_t sname[GDS_MAX_STR_NAME + 1];
+		uint32_t sname = 0; // Index in Database::m_names
+		uint32_t cell = GDS_NO_CELL; // Index of sname in Database::m_cells
 
 		uint16_t col, row;
 
@@ -52,28 +61,184 @@ namespace GDS
 	};
 
 	struct Cell {
-		wchar_t wstrname[GDS_MAX_STR_NAME + 1];
+		uint32_t strname = 0; // Index in Database::m_names
+
+		std::vector<Pair> pairs; // Vertices of all boundaries and paths
 
 		std::vector<Bndry> boundaries;
 		std::vector<Path> paths;
 		std::vector<SRef> srefs;
 		std::vector<Aref> arefs;
+
+		// Indices in Database::m_cells of the cells referenced by this cell
+		// and of the cells referencing it
+		std::vector<uint32_t> children;
+		std::vector<uint32_t> parents;
+
+		// Bounding box (min, max) of the cell including the cells it
+		// references; min > max for an empty cell
+		Pair bbox[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
 	};
 }
 
 namespace GDS
 {
+	struct FlattenCache;
+	struct FlattenState;
+	struct WindowIndex;
+
+	// Receives the polygons of a collapsed cell one by one. The pairs are only
+	// valid during the call.
+	struct PolySink {
+		virtual ~PolySink() = default;
+		virtual void Add(const Pair* pairs, size_t size, uint16_t layer, uint16_t datatype) = 0;
+	};
+
+	// A selection of layers, each with all its datatypes or only some
+	struct LayerFilter {
+		void Add(uint16_t layer); // All datatypes of layer
+		void Add(uint16_t layer, uint16_t datatype);
+
+		bool Selected(uint16_t layer, uint16_t datatype) const
+		{
+			uint8_t state = m_layers[layer];
+
+			return state == ALL || (state == SOME && m_datatypes.count((uint32_t(layer) << 16) | datatype));
+		}
+
+		enum : uint8_t { NONE, ALL, SOME };
+
+		std::vector<uint8_t> m_layers = std::vector<uint8_t>(0x10000, NONE);
+		std::unordered_set<uint32_t> m_datatypes; // layer << 16 | datatype
+	};
+
+	// A reference on the path from a top cell to a cell instance
+	struct InstanceStep {
+		uint32_t cell; // Index in Database::m_cells of the referenced cell
+		uint32_t element; // Index of the SREF or AREF in the referencing cell
+		uint32_t ref; // col * rows + row in an AREF, 0 for an SREF
+		bool aref;
+	};
+
+	// Receives the results of Database::QueryWindow. A path runs from the top
+	// cell down and is only valid during the call; depth 0 is the top cell.
+	struct WindowSink {
+		virtual ~WindowSink() = default;
+
+		// A cell instance whose bounding box overlaps the window, before the
+		// polygons in it
+		virtual void Instance(const InstanceStep* /*path*/, size_t /*depth*/) {}
+
+		// A polygon overlapping the window, in the coordinates of the top
+		// cell, and the path of the instance it is in
+		virtual void Add(const InstanceStep* path, size_t depth, const Pair* pairs, size_t size, uint16_t layer, uint16_t datatype) = 0;
+	};
+
+	// The density map of Database::CollapseDensity: per layer, the fraction
+	// of every tile covered by the polygons on it
+	struct DensityMap {
+		double x0 = 0.0, y0 = 0.0; // Lower left of the grid in user units
+		double tile_w = 0.0, tile_h = 0.0;
+		unsigned cols = 0, rows = 0;
+
+		// cols * rows values per layer, row by row from the lower left
+		// (index row * cols + col)
+		std::unordered_map<uint16_t, std::vector<double>> layers;
+	};
+
 	struct Database {
 		
-		Database(const wchar_t* file); // Construct from a GDS file
-
-		// Collapses cell and write to file and/or a Polygon vector.
-		void CollapseCell(const wchar_t* cell, const double* bounds, uint64_t max_polys, const wchar_t* dest, std::vector<Polygon>* pset);
+		// Construct from a GDS file. The file is parsed in a memory mapped view
+		// unless map_file is false or mapping fails, then it is read with fread.
+		// The structures of a mapped file are decoded on up to 'threads' threads
+		// (0 for one per hardware thread).
+		// With a filter only the BOUNDARY and PATH elements it selects are
+		// kept; the others are skipped without decoding their vertices.
+		Database(const wchar_t* file, bool map_file = true, unsigned threads = 0, const LayerFilter* filter = nullptr);
+
+		// Load the GDS file again after it changed, from file or the file it
+		// was loaded from if nullptr. Only the structures whose records after
+		// BGNSTR differ from before (by a hash, then byte for byte against a
+		// copy kept since the last load) are decoded again, on up to 'threads'
+		// threads, with the filter the database was constructed with. The
+		// bounding boxes, window index and cached polygons of the other cells
+		// are kept, unless a cell they reference changed. A file that cannot
+		// be mapped is loaded again as a whole.
+		void Reload(const wchar_t* file = nullptr, unsigned threads = 0);
+
+		// Collapses cell and write to file and/or a Polygon vector. With more than
+		// one thread (0 for one per hardware thread) the hierarchy is flattened
+		// in parallel; the output is the same as with a single thread.
+		void CollapseCell(const wchar_t* cell, const double* bounds, uint64_t max_polys, const wchar_t* dest, std::vector<Polygon>* pset, unsigned threads = 1);
+
+		// Collapses cell and streams the polygons to sink without storing them.
+		// The sink is called in output order from the calling thread; with more
+		// than one thread the polygons are buffered per task until merged.
+		void CollapseCell(const wchar_t* cell, const double* bounds, uint64_t max_polys, PolySink& sink, unsigned threads = 1);
+
+		// Collapses cell in a grid of cols x rows equal tiles over its bounding
+		// box and write every tile to its own file, named dest followed by
+		// "_<col>_<row>.gds" (col and row from 0 at the lower left). The tiles
+		// are flattened in parallel on up to 'threads' threads (0 for one per
+		// hardware thread), each as CollapseCell does for the tile as bounds;
+		// a polygon overlapping several tiles is written to each of them.
+		// max_polys limits the polygons per tile.
+		void CollapseTiles(const wchar_t* cell, unsigned cols, unsigned rows, uint64_t max_polys, const wchar_t* dest, unsigned threads = 0);
+
+		// Compute the density map of cell over bounds (nullptr for the cell
+		// extent) in tiles of tile_w x tile_h user units, the last column and
+		// row cut to the extent, instead of outputting polygons. The cell is
+		// flattened once on up to 'threads' threads (0 for one per hardware
+		// thread), every polygon cut to the tiles it overlaps. Per tile and
+		// layer the polygons that overlap others are merged, so that they
+		// count once, and the others are summed; a tile keeps the union of
+		// its polygons instead of them when they grow many, and nothing once
+		// one covers it.
+		void CollapseDensity(const wchar_t* cell, const double* bounds, double tile_w, double tile_h, DensityMap& map, unsigned threads = 0);
+
+		// Rasterize cell over bounds (nullptr for the cell extent) to a
+		// width x height image, keeping only the polygons selected by layers
+		// (nullptr for all of them), as the covered part of every pixel or,
+		// without antialias, as 0 or 255 by whether half of it is covered.
+		// The image is done in square tiles on up to 'threads' threads (0 for
+		// one per hardware thread), each finding its polygons as QueryWindow
+		// does and merging them, so overlapping polygons count once.
+		void Rasterize(const wchar_t* cell, const double* bounds, unsigned width, unsigned height, const LayerFilter* layers, bool antialias, RasterImage& image, unsigned threads = 0);
+
+		// Find the instances and polygons of cell overlapping the window bounds
+		// (xmin, ymin, xmax, ymax in user units), the same polygons in the
+		// same order as CollapseCell gives for bounds. Only the parts of the
+		// hierarchy overlapping the window are visited, through an index of
+		// the elements and references of every cell, built when first needed.
+		void QueryWindow(const wchar_t* cell, const double* bounds, WindowSink& sink);
+
+		// Flatten only the elements selected by filter from now on (nullptr
+		// for all of them), skipping the references to cells without any.
+		// Elements left out when loading stay out.
+		void SetLayerFilter(const LayerFilter* filter);
+
+		// Cut the polygons crossing the bounds of CollapseCell, CollapseTiles,
+		// FlattenIterator and QueryWindow to the bounds instead of passing
+		// them whole. Manhattan polygons are cut exactly; the vertices where
+		// other edges cross the bounds are rounded.
+		void SetClipToBounds(bool clip);
+
+		// Keep the flattened polygons of referenced cells in a cache of at most
+		// max_bytes, so that further instances of a cell only transform them.
+		// The least recently used cells are evicted first; 0 disables it.
+		// Only instances at a multiple of 90 degrees and an integer mag, of
+		// cells with only such references below them, are taken from the
+		// cache, so the output is the same as without it.
+		void SetFlattenCache(size_t max_bytes);
 
 		void AllCells(std::vector<std::wstring>& sset); // Write all the cells to a vector
 
 		void TopCells(std::vector<std::wstring>& sset); // Write the top cells to a vector
 
+		void ChildCells(const wchar_t* cell, std::vector<std::wstring>& sset); // Write the cells referenced by cell to a vector
+
+		void ParentCells(const wchar_t* cell, std::vector<std::wstring>& sset); // Write the cells referencing cell to a vector
+
 		
 		double m_uu_per_dbunit = 0.0, m_meter_per_dbunit = 0.0; // Units from the GDS_UNITS record
 
@@ -82,17 +247,65 @@ namespace GDS
 
 		std::vector<Cell> m_cells;
 
+		// Interned cell names; cells, SREFs and AREFs refer to a name by its
+		// index in m_names. Index 0 is the empty name.
+		std::vector<std::wstring> m_names = { std::wstring() };
+		std::unordered_map<std::wstring, uint32_t> m_nameIndex = { { std::wstring(), 0 } };
+
+		// Index in m_cells by name index (GDS_NO_CELL if there is no such cell)
+		std::vector<uint32_t> m_cellIndex;
+
 		std::vector<std::wstring> m_libnames;
 
 		uint16_t m_version = 0; // The GDS version (must be 6 or 600)
 
+		std::shared_ptr<FlattenCache> m_cache; // See SetFlattenCache
+		std::shared_ptr<WindowIndex> m_windowIndex; // See QueryWindow
+
+		std::shared_ptr<const LayerFilter> m_filter; // See SetLayerFilter; nullptr for all layers
+		std::shared_ptr<const LayerFilter> m_loadFilter; // The filter of the constructor
+
+		bool m_clip = false; // See SetClipToBounds
+
+		// Per cell, whether it or a cell it references has elements selected
+		// by m_filter
+		std::vector<uint8_t> m_cellSelected;
+
+		// Per cell, a hash of the records of its structure after BGNSTR, to
+		// find the changed ones on Reload; empty if not read from a mapped file
+		std::vector<uint64_t> m_fingerprints;
+
+		// A copy of those records, cell after cell, cell i from
+		// m_structOffsets[i] to m_structOffsets[i + 1], to confirm that a
+		// structure with the same fingerprint is unchanged
+		std::vector<uint8_t> m_structBytes;
+		std::vector<size_t> m_structOffsets;
+
 		// The raw data in the GDS_UNITS record read (so as to easily write back
 		// to an output file without conversions.
 		uint8_t m_units[16] = { 0 };
 	};
 
+	// Flattens a cell in batches of polygons. The hierarchy is walked with an
+	// explicit stack instead of recursion, so a batch can stop after any
+	// polygon and the next one goes on from there. The database must not
+	// change while the iterator is in use.
+	struct FlattenIterator {
+		FlattenIterator(Database& gds, const wchar_t* cell, const double* bounds = nullptr);
+		~FlattenIterator();
+
+		// Pass up to max_polys more polygons to sink. Return false once the
+		// cell is done (the last batch may be empty).
+		bool Next(uint64_t max_polys, PolySink& sink);
+
+		std::unique_ptr<FlattenState> m_state;
+	};
+
 	// Static helper function (unrelated to this class).
-	bool PointInPoly(Pair* poly, int n, Pair p);
+	bool PointInPoly(const Pair* poly, int n, Pair p);
+
+	// Set inside[k] to 1 if points[k] is inside the polygon and to 0 if not
+	void PointsInPoly(const Pair* poly, int n, const Pair* points, size_t count, uint8_t* inside);
 }
 
 
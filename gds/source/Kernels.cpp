@@ -0,0 +1,618 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "Kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if !defined(GDS_NO_SIMD) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define GDS_X86
+#endif
+
+#ifdef GDS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GDS_TARGET(isa)
+#else
+// GCC and Clang only emit the instructions in functions that ask for them
+#define GDS_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace GDS {
+	struct KernelTable {
+		void (*decode)(Pair*, const uint8_t*, size_t);
+		void (*translate)(Pair*, const Pair*, size_t, int32_t, int32_t);
+		void (*ortho)(Pair*, const Pair*, size_t, const int32_t*, int32_t, int32_t);
+		void (*affine)(Pair*, const Pair*, size_t, double, double, double, double, int32_t, int32_t);
+		void (*bound)(Pair*, const Pair*, size_t);
+		void (*inside)(const Pair*, size_t, const Pair*, size_t, uint8_t*);
+		const char* name;
+	};
+}
+
+using namespace GDS;
+
+// Plain C++ kernels, also used for the tails of the vector kernels
+
+static int32_t ReadInt(const uint8_t* p)
+{
+	return int32_t(uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]));
+}
+
+static void DecodeScalar(Pair* out, const uint8_t* buf, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		out[i].x = ReadInt(buf + 8 * i);
+		out[i].y = ReadInt(buf + 8 * i + 4);
+	}
+}
+
+static void TranslateScalar(Pair* out, const Pair* in, size_t count, int32_t x, int32_t y)
+{
+	for (size_t i = 0; i < count; i++) {
+		out[i].x = int32_t(x + int64_t(in[i].x));
+		out[i].y = int32_t(y + int64_t(in[i].y));
+	}
+}
+
+static void OrthoScalar(Pair* out, const Pair* in, size_t count, const int32_t* m, int32_t x, int32_t y)
+{
+	for (size_t i = 0; i < count; i++) {
+		out[i].x = int32_t(x + int64_t(m[0]) * in[i].x + int64_t(m[1]) * in[i].y);
+		out[i].y = int32_t(y + int64_t(m[2]) * in[i].x + int64_t(m[3]) * in[i].y);
+	}
+}
+
+static void AffineScalar(Pair* out, const Pair* in, size_t count, double cos_a, double sin_a, double mag, double sign, int32_t x, int32_t y)
+{
+	for (size_t i = 0; i < count; i++) {
+		double px = in[i].x, py = sign * in[i].y;
+
+		out[i].x = (int)(x + mag * (px * cos_a - py * sin_a));
+		out[i].y = (int)(y + mag * (px * sin_a + py * cos_a));
+	}
+}
+
+static void BoundScalar(Pair* box, const Pair* p, size_t count)
+{
+	int32_t minx = box[0].x, miny = box[0].y, maxx = box[1].x, maxy = box[1].y;
+
+	for (size_t i = 0; i < count; i++) {
+		if (p[i].x < minx) minx = p[i].x;
+		if (p[i].y < miny) miny = p[i].y;
+		if (p[i].x > maxx) maxx = p[i].x;
+		if (p[i].y > maxy) maxy = p[i].y;
+	}
+
+	box[0] = { minx, miny };
+	box[1] = { maxx, maxy };
+}
+
+// The point in polygon kernels count the edges crossed by a vertical ray up
+// from the point. Edge (a, b) crosses it when the point is right of exactly
+// one of a and b and below the edge, which is
+// side = (py - ay) * dx - (px - ax) * dy having the sign of -dx.
+// In doubles the differences are exact but the products only up to 2^53;
+// side is off by at most SIDE_ERROR times the sum of the absolute products,
+// and when it is not further from zero than that CrossesExact decides.
+static const double SIDE_ERROR = 3.4e-16;
+
+static bool CrossesExact(Pair a, Pair b, Pair p)
+{
+	// With all factors under 2^33, side is split on the low 16 bits of dx
+	// and dy into hi * 2^16 + lo, whose parts fit in 64 bits
+	int64_t ex = int64_t(p.x) - a.x, ey = int64_t(p.y) - a.y;
+	int64_t dx = int64_t(b.x) - a.x, dy = int64_t(b.y) - a.y;
+	int64_t dx_lo = dx & 0xFFFF, dy_lo = dy & 0xFFFF;
+
+	int64_t hi = ey * ((dx - dx_lo) / 0x10000) - ex * ((dy - dy_lo) / 0x10000);
+	int64_t lo = ey * dx_lo - ex * dy_lo;
+
+	// Carry all but the low 16 bits of lo to hi, leaving 0 <= lo < 2^16,
+	// so that the sign of side is that of hi unless hi is 0
+	int64_t lo_low = lo & 0xFFFF;
+
+	hi += (lo - lo_low) / 0x10000;
+	lo = lo_low;
+
+	int sign = hi > 0 ? 1 : hi < 0 ? -1 : lo > 0 ? 1 : 0;
+
+	return dx > 0 ? sign < 0 : sign > 0;
+}
+
+static void InsideScalar(const Pair* poly, size_t n, const Pair* points, size_t count, uint8_t* inside)
+{
+	for (size_t k = 0; k < count; k++) {
+		double px = points[k].x, py = points[k].y;
+		bool odd = false;
+
+		for (size_t i = 0; i + 1 < n; i++) {
+			double ax = poly[i].x, ay = poly[i].y, bx = poly[i + 1].x, by = poly[i + 1].y;
+
+			if ((ax <= px) != (bx <= px)) {
+				double dx = bx - ax, dy = by - ay;
+				double t1 = (py - ay) * dx, t2 = (px - ax) * dy, side = t1 - t2;
+
+				if (std::fabs(side) <= SIDE_ERROR * (std::fabs(t1) + std::fabs(t2))) {
+					if (CrossesExact(poly[i], poly[i + 1], points[k]))
+						odd = !odd;
+				}
+				else if ((dx > 0.0 ? side : -side) < 0.0)
+					odd = !odd;
+			}
+		}
+
+		inside[k] = odd;
+	}
+}
+
+#ifdef GDS_X86
+
+// SSE4.1 kernels, two pairs at a time
+
+GDS_TARGET("sse4.1") static void DecodeSse41(Pair* out, const uint8_t* buf, size_t count)
+{
+	const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i = 0;
+
+	for (; i + 2 <= count; i += 2) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 8 * i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_shuffle_epi8(v, swap));
+	}
+
+	DecodeScalar(out + i, buf + 8 * i, count - i);
+}
+
+GDS_TARGET("sse4.1") static void TranslateSse41(Pair* out, const Pair* in, size_t count, int32_t x, int32_t y)
+{
+	const __m128i t = _mm_setr_epi32(x, y, x, y);
+	size_t i = 0;
+
+	for (; i + 2 <= count; i += 2) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi32(t, v));
+	}
+
+	TranslateScalar(out + i, in + i, count - i, x, y);
+}
+
+GDS_TARGET("sse4.1") static void OrthoSse41(Pair* out, const Pair* in, size_t count, const int32_t* m, int32_t x, int32_t y)
+{
+	// (x', y') = (x, y) + (m0, m3) * (px, py) + (m1, m2) * (py, px)
+	const __m128i a = _mm_setr_epi32(m[0], m[3], m[0], m[3]);
+	const __m128i b = _mm_setr_epi32(m[1], m[2], m[1], m[2]);
+	const __m128i t = _mm_setr_epi32(x, y, x, y);
+	size_t i = 0;
+
+	for (; i + 2 <= count; i += 2) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		__m128i s = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+		__m128i r = _mm_add_epi32(t, _mm_add_epi32(_mm_mullo_epi32(a, v), _mm_mullo_epi32(b, s)));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), r);
+	}
+
+	OrthoScalar(out + i, in + i, count - i, m, x, y);
+}
+
+GDS_TARGET("sse4.1") static void AffineSse41(Pair* out, const Pair* in, size_t count, double cos_a, double sin_a, double mag, double sign, int32_t x, int32_t y)
+{
+	const __m128d c = _mm_set1_pd(cos_a), s = _mm_set1_pd(sin_a), k = _mm_set1_pd(mag), sg = _mm_set1_pd(sign);
+	const __m128d tx = _mm_set1_pd(x), ty = _mm_set1_pd(y);
+	size_t i = 0;
+
+	for (; i + 2 <= count; i += 2) {
+		// (x0, x1, y0, y1)
+		__m128i v = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), _MM_SHUFFLE(3, 1, 2, 0));
+		__m128d px = _mm_cvtepi32_pd(v);
+		__m128d py = _mm_mul_pd(sg, _mm_cvtepi32_pd(_mm_unpackhi_epi64(v, v)));
+
+		__m128d ox = _mm_add_pd(tx, _mm_mul_pd(k, _mm_sub_pd(_mm_mul_pd(px, c), _mm_mul_pd(py, s))));
+		__m128d oy = _mm_add_pd(ty, _mm_mul_pd(k, _mm_add_pd(_mm_mul_pd(px, s), _mm_mul_pd(py, c))));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi32(_mm_cvttpd_epi32(ox), _mm_cvttpd_epi32(oy)));
+	}
+
+	AffineScalar(out + i, in + i, count - i, cos_a, sin_a, mag, sign, x, y);
+}
+
+GDS_TARGET("sse4.1") static void BoundSse41(Pair* box, const Pair* p, size_t count)
+{
+	size_t i = 0;
+
+	if (count >= 4) {
+		__m128i lo = _mm_setr_epi32(box[0].x, box[0].y, box[0].x, box[0].y);
+		__m128i hi = _mm_setr_epi32(box[1].x, box[1].y, box[1].x, box[1].y);
+
+		for (; i + 2 <= count; i += 2) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+			lo = _mm_min_epi32(lo, v);
+			hi = _mm_max_epi32(hi, v);
+		}
+
+		lo = _mm_min_epi32(lo, _mm_unpackhi_epi64(lo, lo));
+		hi = _mm_max_epi32(hi, _mm_unpackhi_epi64(hi, hi));
+		box[0].x = _mm_cvtsi128_si32(lo);
+		box[0].y = _mm_extract_epi32(lo, 1);
+		box[1].x = _mm_cvtsi128_si32(hi);
+		box[1].y = _mm_extract_epi32(hi, 1);
+	}
+
+	BoundScalar(box, p + i, count - i);
+}
+
+GDS_TARGET("sse4.1") static void InsideSse41(const Pair* poly, size_t n, const Pair* points, size_t count, uint8_t* inside)
+{
+	// Eight points at a time, so that the set up of an edge is shared
+	const __m128d zero = _mm_setzero_pd(), sign = _mm_set1_pd(-0.0);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128d px[4], py[4], odd[4];
+		uint8_t exact[8] = { 0 }; // Corrections by CrossesExact
+
+		for (int j = 0; j < 4; j++) {
+			px[j] = _mm_setr_pd(points[k + 2 * j].x, points[k + 2 * j + 1].x);
+			py[j] = _mm_setr_pd(points[k + 2 * j].y, points[k + 2 * j + 1].y);
+			odd[j] = zero;
+		}
+
+		int32_t minx = points[k].x, maxx = points[k].x;
+		double maxy = 0.0;
+		for (size_t j = k; j < k + 8; j++) {
+			minx = std::min(minx, points[j].x);
+			maxx = std::max(maxx, points[j].x);
+			maxy = std::max(maxy, std::fabs(double(points[j].y)));
+		}
+
+		for (size_t i = 0; i + 1 < n; i++) {
+			// Skip the edges no point of the block is straddling; with the
+			// points sorted on x that is most edges of a large polygon
+			int32_t lo = std::min(poly[i].x, poly[i + 1].x), hi = std::max(poly[i].x, poly[i + 1].x);
+			if (hi <= minx || lo > maxx)
+				continue;
+
+			double ax = poly[i].x, ay = poly[i].y, bx = poly[i + 1].x, by = poly[i + 1].y;
+			double dx = bx - ax, dy = by - ay;
+
+			// Multiplying by the sign of dx is exact. For the points straddling
+			// the edge |px - ax| <= |dx|, which bounds the error of side.
+			__m128d sdx = _mm_set1_pd(dx > 0.0 ? dx : -dx), sdy = _mm_set1_pd(dx > 0.0 ? dy : -dy);
+			__m128d vax = _mm_set1_pd(ax), vay = _mm_set1_pd(ay), vbx = _mm_set1_pd(bx);
+			__m128d error = _mm_set1_pd(SIDE_ERROR * std::fabs(dx) * (maxy + std::fabs(ay) + std::fabs(dy)));
+
+			__m128d cross[4], unsure[4], any = zero;
+
+			for (int j = 0; j < 4; j++) {
+				__m128d straddle = _mm_xor_pd(_mm_cmple_pd(vax, px[j]), _mm_cmple_pd(vbx, px[j]));
+				__m128d side = _mm_sub_pd(_mm_mul_pd(_mm_sub_pd(py[j], vay), sdx), _mm_mul_pd(_mm_sub_pd(px[j], vax), sdy));
+
+				cross[j] = _mm_and_pd(straddle, _mm_cmplt_pd(side, zero));
+				unsure[j] = _mm_and_pd(straddle, _mm_cmple_pd(_mm_andnot_pd(sign, side), error));
+				odd[j] = _mm_xor_pd(odd[j], cross[j]);
+				any = _mm_or_pd(any, unsure[j]);
+			}
+
+			// Correct the crossings side may have wrong
+			if (_mm_movemask_pd(any)) {
+				for (int j = 0; j < 4; j++) {
+					int mask = _mm_movemask_pd(unsure[j]), crossed = _mm_movemask_pd(cross[j]);
+
+					for (int b = 0; b < 2; b++)
+						if ((mask >> b & 1) && CrossesExact(poly[i], poly[i + 1], points[k + 2 * j + b]) != bool(crossed >> b & 1))
+							exact[2 * j + b] ^= 1;
+				}
+			}
+		}
+
+		for (int j = 0; j < 4; j++) {
+			int mask = _mm_movemask_pd(odd[j]);
+			inside[k + 2 * j] = (mask & 1) ^ exact[2 * j];
+			inside[k + 2 * j + 1] = ((mask >> 1) & 1) ^ exact[2 * j + 1];
+		}
+	}
+
+	InsideScalar(poly, n, points + k, count - k, inside + k);
+}
+
+// AVX2 kernels, four pairs at a time. They clear the upper halves of the
+// registers before the plain C++ tails, which are SSE code; mixing the two
+// without that stalls for hundreds of cycles on many CPUs.
+
+GDS_TARGET("avx2") static void DecodeAvx2(Pair* out, const uint8_t* buf, size_t count)
+{
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + 8 * i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_shuffle_epi8(v, swap));
+	}
+
+	_mm256_zeroupper();
+	DecodeScalar(out + i, buf + 8 * i, count - i);
+}
+
+GDS_TARGET("avx2") static void TranslateAvx2(Pair* out, const Pair* in, size_t count, int32_t x, int32_t y)
+{
+	const __m256i t = _mm256_setr_epi32(x, y, x, y, x, y, x, y);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi32(t, v));
+	}
+
+	_mm256_zeroupper();
+	TranslateScalar(out + i, in + i, count - i, x, y);
+}
+
+GDS_TARGET("avx2") static void OrthoAvx2(Pair* out, const Pair* in, size_t count, const int32_t* m, int32_t x, int32_t y)
+{
+	const __m256i a = _mm256_setr_epi32(m[0], m[3], m[0], m[3], m[0], m[3], m[0], m[3]);
+	const __m256i b = _mm256_setr_epi32(m[1], m[2], m[1], m[2], m[1], m[2], m[1], m[2]);
+	const __m256i t = _mm256_setr_epi32(x, y, x, y, x, y, x, y);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		__m256i s = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+		__m256i r = _mm256_add_epi32(t, _mm256_add_epi32(_mm256_mullo_epi32(a, v), _mm256_mullo_epi32(b, s)));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), r);
+	}
+
+	_mm256_zeroupper();
+	OrthoScalar(out + i, in + i, count - i, m, x, y);
+}
+
+GDS_TARGET("avx2") static void AffineAvx2(Pair* out, const Pair* in, size_t count, double cos_a, double sin_a, double mag, double sign, int32_t x, int32_t y)
+{
+	const __m256d c = _mm256_set1_pd(cos_a), s = _mm256_set1_pd(sin_a), k = _mm256_set1_pd(mag), sg = _mm256_set1_pd(sign);
+	const __m256d tx = _mm256_set1_pd(x), ty = _mm256_set1_pd(y);
+	const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		// (x0, x1, x2, x3, y0, y1, y2, y3)
+		__m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)), split);
+		__m256d px = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+		__m256d py = _mm256_mul_pd(sg, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)));
+
+		__m256d ox = _mm256_add_pd(tx, _mm256_mul_pd(k, _mm256_sub_pd(_mm256_mul_pd(px, c), _mm256_mul_pd(py, s))));
+		__m256d oy = _mm256_add_pd(ty, _mm256_mul_pd(k, _mm256_add_pd(_mm256_mul_pd(px, s), _mm256_mul_pd(py, c))));
+
+		__m128i ix = _mm256_cvttpd_epi32(ox), iy = _mm256_cvttpd_epi32(oy);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi32(ix, iy));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 2), _mm_unpackhi_epi32(ix, iy));
+	}
+
+	_mm256_zeroupper();
+	AffineScalar(out + i, in + i, count - i, cos_a, sin_a, mag, sign, x, y);
+}
+
+GDS_TARGET("avx2") static void BoundAvx2(Pair* box, const Pair* p, size_t count)
+{
+	size_t i = 0;
+
+	if (count >= 8) {
+		__m256i lo = _mm256_setr_epi32(box[0].x, box[0].y, box[0].x, box[0].y, box[0].x, box[0].y, box[0].x, box[0].y);
+		__m256i hi = _mm256_setr_epi32(box[1].x, box[1].y, box[1].x, box[1].y, box[1].x, box[1].y, box[1].x, box[1].y);
+
+		for (; i + 4 <= count; i += 4) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+			lo = _mm256_min_epi32(lo, v);
+			hi = _mm256_max_epi32(hi, v);
+		}
+
+		__m128i lo2 = _mm_min_epi32(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+		__m128i hi2 = _mm_max_epi32(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+
+		lo2 = _mm_min_epi32(lo2, _mm_unpackhi_epi64(lo2, lo2));
+		hi2 = _mm_max_epi32(hi2, _mm_unpackhi_epi64(hi2, hi2));
+		box[0].x = _mm_cvtsi128_si32(lo2);
+		box[0].y = _mm_extract_epi32(lo2, 1);
+		box[1].x = _mm_cvtsi128_si32(hi2);
+		box[1].y = _mm_extract_epi32(hi2, 1);
+	}
+
+	_mm256_zeroupper();
+	BoundScalar(box, p + i, count - i);
+}
+
+GDS_TARGET("avx2") static void InsideAvx2(const Pair* poly, size_t n, const Pair* points, size_t count, uint8_t* inside)
+{
+	// Sixteen points at a time, so that the set up of an edge is shared
+	const __m256d zero = _mm256_setzero_pd(), sign = _mm256_set1_pd(-0.0);
+	const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m256d px[4], py[4], odd[4];
+		uint8_t exact[16] = { 0 }; // Corrections by CrossesExact
+
+		for (int j = 0; j < 4; j++) {
+			// (x0, x1, x2, x3, y0, y1, y2, y3)
+			__m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(points + k + 4 * j)), split);
+			px[j] = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+			py[j] = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+			odd[j] = zero;
+		}
+
+		int32_t minx = points[k].x, maxx = points[k].x;
+		double maxy = 0.0;
+		for (size_t j = k; j < k + 16; j++) {
+			minx = std::min(minx, points[j].x);
+			maxx = std::max(maxx, points[j].x);
+			maxy = std::max(maxy, std::fabs(double(points[j].y)));
+		}
+
+		for (size_t i = 0; i + 1 < n; i++) {
+			// Skip the edges no point of the block is straddling; with the
+			// points sorted on x that is most edges of a large polygon
+			int32_t lo = std::min(poly[i].x, poly[i + 1].x), hi = std::max(poly[i].x, poly[i + 1].x);
+			if (hi <= minx || lo > maxx)
+				continue;
+
+			double ax = poly[i].x, ay = poly[i].y, bx = poly[i + 1].x, by = poly[i + 1].y;
+			double dx = bx - ax, dy = by - ay;
+
+			// As in InsideSse41
+			__m256d sdx = _mm256_set1_pd(dx > 0.0 ? dx : -dx), sdy = _mm256_set1_pd(dx > 0.0 ? dy : -dy);
+			__m256d vax = _mm256_set1_pd(ax), vay = _mm256_set1_pd(ay), vbx = _mm256_set1_pd(bx);
+			__m256d error = _mm256_set1_pd(SIDE_ERROR * std::fabs(dx) * (maxy + std::fabs(ay) + std::fabs(dy)));
+
+			__m256d cross[4], unsure[4], any = zero;
+
+			for (int j = 0; j < 4; j++) {
+				__m256d straddle = _mm256_xor_pd(_mm256_cmp_pd(vax, px[j], _CMP_LE_OQ), _mm256_cmp_pd(vbx, px[j], _CMP_LE_OQ));
+				__m256d side = _mm256_sub_pd(_mm256_mul_pd(_mm256_sub_pd(py[j], vay), sdx), _mm256_mul_pd(_mm256_sub_pd(px[j], vax), sdy));
+
+				cross[j] = _mm256_and_pd(straddle, _mm256_cmp_pd(side, zero, _CMP_LT_OQ));
+				unsure[j] = _mm256_and_pd(straddle, _mm256_cmp_pd(_mm256_andnot_pd(sign, side), error, _CMP_LE_OQ));
+				odd[j] = _mm256_xor_pd(odd[j], cross[j]);
+				any = _mm256_or_pd(any, unsure[j]);
+			}
+
+			if (_mm256_movemask_pd(any)) {
+				for (int j = 0; j < 4; j++) {
+					int mask = _mm256_movemask_pd(unsure[j]), crossed = _mm256_movemask_pd(cross[j]);
+
+					for (int b = 0; b < 4; b++)
+						if ((mask >> b & 1) && CrossesExact(poly[i], poly[i + 1], points[k + 4 * j + b]) != bool(crossed >> b & 1))
+							exact[4 * j + b] ^= 1;
+				}
+			}
+		}
+
+		for (int j = 0; j < 4; j++) {
+			int mask = _mm256_movemask_pd(odd[j]);
+			for (int b = 0; b < 4; b++)
+				inside[k + 4 * j + b] = ((mask >> b) & 1) ^ exact[4 * j + b];
+		}
+	}
+
+	_mm256_zeroupper();
+	InsideScalar(poly, n, points + k, count - k, inside + k);
+}
+
+static bool CpuHasAvx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// The OS must save the AVX registers as well
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool CpuHasSse41()
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[2] & (1 << 19)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#endif
+
+static KernelTable SelectKernels()
+{
+	KernelTable table = { DecodeScalar, TranslateScalar, OrthoScalar, AffineScalar, BoundScalar, InsideScalar, "scalar" };
+
+#ifdef GDS_X86
+	if (CpuHasAvx2())
+		table = { DecodeAvx2, TranslateAvx2, OrthoAvx2, AffineAvx2, BoundAvx2, InsideAvx2, "avx2" };
+	else if (CpuHasSse41())
+		table = { DecodeSse41, TranslateSse41, OrthoSse41, AffineSse41, BoundSse41, InsideSse41, "sse4.1" };
+#endif
+
+	return table;
+}
+
+static KernelTable& Kernels()
+{
+	static KernelTable table = SelectKernels();
+
+	return table;
+}
+
+void GDS::DecodePairs(Pair* out, const uint8_t* buf, size_t count)
+{
+	Kernels().decode(out, buf, count);
+}
+
+void GDS::TranslatePairs(Pair* out, const Pair* in, size_t count, int32_t x, int32_t y)
+{
+	Kernels().translate(out, in, count, x, y);
+}
+
+void GDS::TransformPairs(Pair* out, const Pair* in, size_t count, const int32_t* m, int32_t x, int32_t y)
+{
+	Kernels().ortho(out, in, count, m, x, y);
+}
+
+void GDS::TransformPairs(Pair* out, const Pair* in, size_t count, double cos_a, double sin_a, double mag, double sign, int32_t x, int32_t y)
+{
+	Kernels().affine(out, in, count, cos_a, sin_a, mag, sign, x, y);
+}
+
+void GDS::BoundPairs(Pair* box, const Pair* p, size_t count)
+{
+	Kernels().bound(box, p, count);
+}
+
+void GDS::InsidePairs(const Pair* poly, size_t n, const Pair* points, size_t count, uint8_t* inside)
+{
+	Kernels().inside(poly, n, points, count, inside);
+}
+
+const char* GDS::KernelSet()
+{
+	return Kernels().name;
+}
+
+bool GDS::SetKernelSet(const char* name)
+{
+	KernelTable table = { DecodeScalar, TranslateScalar, OrthoScalar, AffineScalar, BoundScalar, InsideScalar, "scalar" };
+
+#ifdef GDS_X86
+	if (strcmp(name, "avx2") == 0 && CpuHasAvx2())
+		table = { DecodeAvx2, TranslateAvx2, OrthoAvx2, AffineAvx2, BoundAvx2, InsideAvx2, "avx2" };
+	else if (strcmp(name, "sse4.1") == 0 && CpuHasSse41())
+		table = { DecodeSse41, TranslateSse41, OrthoSse41, AffineSse41, BoundSse41, InsideSse41, "sse4.1" };
+#endif
+
+	if (strcmp(name, table.name) != 0)
+		return false;
+
+	Kernels() = table;
+
+	return true;
+}
@@ -0,0 +1,53 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#pragma once
+
+#include "Polygon.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace GDS {
+
+	// Kernels over blocks of vertices. On x86 they run on AVX2 or SSE4.1 when
+	// the CPU supports it, chosen at the first call; defining GDS_NO_SIMD
+	// leaves only the plain C++ versions. All versions give the same results.
+
+	// Decode count big-endian XY pairs of a GDS_XY record
+	void DecodePairs(Pair* out, const uint8_t* buf, size_t count);
+
+	// out = (x, y) + in. Wraps around like 32-bit integer arithmetic.
+	void TranslatePairs(Pair* out, const Pair* in, size_t count, int32_t x, int32_t y);
+
+	// out = (x, y) + m * in, with m a row-major integer matrix. Wraps around
+	// like 32-bit integer arithmetic.
+	void TransformPairs(Pair* out, const Pair* in, size_t count, const int32_t* m, int32_t x, int32_t y);
+
+	// out = (x, y) + mag * (in.x * cos_a - sign * in.y * sin_a, in.x * sin_a +
+	// sign * in.y * cos_a) in doubles, truncated to integers
+	void TransformPairs(Pair* out, const Pair* in, size_t count, double cos_a, double sin_a, double mag, double sign, int32_t x, int32_t y);
+
+	// Grow the box (min, max corners) to hold the pairs
+	void BoundPairs(Pair* box, const Pair* p, size_t count);
+
+	// Set inside[k] to 1 if points[k] is inside the closed polygon of n pairs
+	// (the last one equal to the first) and to 0 if not, by the parity of the
+	// edges crossed by a vertical ray up from the point, exactly for any
+	// coordinates. It is fastest with the points sorted on x, when blocks of
+	// points skip the edges away from them.
+	void InsidePairs(const Pair* poly, size_t n, const Pair* points, size_t count, uint8_t* inside);
+
+	// The instruction set of the kernels in use: "avx2", "sse4.1" or "scalar"
+	const char* KernelSet();
+
+	// Use the kernels of another instruction set, as named by KernelSet, to
+	// compare them; false if the CPU or the build does not have it. Not to
+	// be called while other threads use the kernels.
+	bool SetKernelSet(const char* name);
+}
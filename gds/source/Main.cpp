@@ -56,7 +56,8 @@ int wmain()
 		// bottom/left x = 28.7 and y = 45.2 followed by top/right x = 50.0 and y = 85.5
 		// in GDS user units (usually micron). Or enter a null pointer if no bounding
 		// is to be used. This could for a typical GDS cell create many polygons so
-		// do with care.
+		// do with care. Polygons crossing the bounds are output whole unless
+		// gds.SetClipToBounds(true) is called first.
 		double bounds[4] = { 28.7, 45.2, 50.0, 85.5 };
 
 		// Set an upper limit to the number of polys to output.
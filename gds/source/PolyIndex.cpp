@@ -0,0 +1,293 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "PolyIndex.h"
+#include "Gds.h"
+#include "Kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include <functional>
+#include <queue>
+#include <tuple>
+
+using namespace GDS;
+
+// Entries per node
+static const size_t NODE_SIZE = 16;
+
+static int64_t CenterX(const BoxTree::Entry& e)
+{
+	return int64_t(e.box[0].x) + e.box[1].x;
+}
+
+static int64_t CenterY(const BoxTree::Entry& e)
+{
+	return int64_t(e.box[0].y) + e.box[1].y;
+}
+
+static void PackLevel(std::vector<BoxTree::Entry>& entries, size_t begin, size_t end)
+{
+	// Add the nodes over the entries [begin, end) with Sort-Tile-Recursive:
+	// sort on x, cut in vertical slices of whole nodes, sort every slice on y
+	// and take the nodes from the slices in order.
+
+	typedef BoxTree::Entry Entry;
+
+	size_t nodes = (end - begin + NODE_SIZE - 1) / NODE_SIZE;
+	size_t slices = size_t(ceil(sqrt(double(nodes))));
+	size_t slice_size = ((nodes + slices - 1) / slices) * NODE_SIZE;
+
+	std::sort(entries.begin() + begin, entries.begin() + end,
+		[](const Entry& a, const Entry& b) { return CenterX(a) < CenterX(b); });
+
+	for (size_t s = begin; s < end; s += slice_size) {
+		size_t s_end = std::min(end, s + slice_size);
+
+		std::sort(entries.begin() + s, entries.begin() + s_end,
+			[](const Entry& a, const Entry& b) { return CenterY(a) < CenterY(b); });
+
+		for (size_t n = s; n < s_end; n += NODE_SIZE) {
+			Entry node = { { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } }, uint32_t(n), uint32_t(std::min(s_end, n + NODE_SIZE) - n) };
+
+			for (size_t i = n; i < n + node.count; i++)
+				BoundPairs(node.box, entries[i].box, 2);
+
+			entries.push_back(node);
+		}
+	}
+}
+
+static bool BoxOverlap(const Pair* a, const Pair* b)
+{
+	return a[0].x <= b[1].x && a[1].x >= b[0].x && a[0].y <= b[1].y && a[1].y >= b[0].y;
+}
+
+static double BoxDistance2(const Pair* box, Pair p)
+{
+	// Squared distance from p to box, 0 inside
+
+	double dx = std::max(0.0, std::max(double(box[0].x) - p.x, double(p.x) - box[1].x));
+	double dy = std::max(0.0, std::max(double(box[0].y) - p.y, double(p.y) - box[1].y));
+
+	return dx * dx + dy * dy;
+}
+
+static double PolyDistance2(const Polygon& poly, Pair p)
+{
+	// Squared distance from p to the outline of poly, 0 inside
+
+	const std::vector<Pair>& v = poly.m_pairs;
+
+	if (PointInPoly(v.data(), int(v.size()), p))
+		return 0.0;
+
+	double best = INFINITY;
+
+	for (size_t i = 0; i + 1 < v.size(); i++) {
+		double ax = v[i].x, ay = v[i].y;
+		double dx = double(v[i + 1].x) - ax, dy = double(v[i + 1].y) - ay;
+		double len2 = dx * dx + dy * dy;
+		double t = len2 > 0.0 ? ((p.x - ax) * dx + (p.y - ay) * dy) / len2 : 0.0;
+
+		t = std::min(1.0, std::max(0.0, t));
+
+		double ex = ax + t * dx - p.x, ey = ay + t * dy - p.y;
+
+		best = std::min(best, ex * ex + ey * ey);
+	}
+
+	return best;
+}
+
+void BoxTree::Add(const Pair* box, uint32_t id)
+{
+	Entry e = { { box[0], box[1] }, id, 0 };
+
+	entries.push_back(e);
+}
+
+void BoxTree::Pack()
+{
+	// Pack level over level until a single root is left
+	size_t begin = 0, end = entries.size();
+
+	while (end - begin > 1) {
+		PackLevel(entries, begin, end);
+		begin = end;
+		end = entries.size();
+	}
+}
+
+void BoxTree::Window(const Pair* box, std::vector<size_t>& hits) const
+{
+	Search([box](const Pair* e) { return BoxOverlap(e, box); }, hits);
+}
+
+PolyIndex::PolyIndex(const std::vector<Polygon>& polys)
+	: m_polys(polys)
+{
+	for (size_t i = 0; i < polys.size(); i++) {
+		const Polygon& poly = polys[i];
+
+		if (poly.m_pairs.empty())
+			continue;
+
+		Pair box[2] = { { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
+
+		BoundPairs(box, poly.m_pairs.data(), poly.m_pairs.size());
+		m_trees[poly.m_layer].Add(box, uint32_t(i));
+	}
+
+	for (auto it = m_trees.begin(); it != m_trees.end(); ++it)
+		it->second.Pack();
+}
+
+void PolyIndex::Window(uint16_t layer, const Pair* box, std::vector<size_t>& hits) const
+{
+	auto tree = m_trees.find(layer);
+
+	if (tree != m_trees.end())
+		tree->second.Window(box, hits);
+}
+
+void PolyIndex::Point(uint16_t layer, Pair p, std::vector<size_t>& hits) const
+{
+	Pair box[2] = { p, p };
+	size_t first = hits.size();
+
+	Window(layer, box, hits);
+
+	// Keep the polygons really containing p
+	auto keep = std::remove_if(hits.begin() + first, hits.end(), [&](size_t i) {
+		return !PointInPoly(m_polys[i].m_pairs.data(), int(m_polys[i].m_pairs.size()), p);
+	});
+
+	hits.erase(keep, hits.end());
+}
+
+void PolyIndex::Points(uint16_t layer, const Pair* points, size_t count, std::vector<std::pair<size_t, size_t>>& hits) const
+{
+	auto tree = m_trees.find(layer);
+
+	if (tree == m_trees.end() || count == 0)
+		return;
+
+	const std::vector<BoxTree::Entry>& entries = tree->second.entries;
+
+	// Depth first over the tree, each node with the indices of the points in
+	// its parent; the indices of a level are kept until its children are done.
+	struct Item {
+		uint32_t entry;
+		size_t level;
+	};
+
+	std::vector<std::vector<size_t>> levels(1);
+	std::vector<Item> stack = { { uint32_t(entries.size() - 1), 0 } };
+	std::vector<Pair> gathered;
+	std::vector<uint8_t> inside;
+
+	// In order of x, which the filtering keeps, so that the points reaching
+	// a polygon are sorted as InsidePairs likes them
+	levels[0].resize(count);
+	for (size_t k = 0; k < count; k++)
+		levels[0][k] = k;
+
+	std::sort(levels[0].begin(), levels[0].end(), [&](size_t a, size_t b) { return points[a].x < points[b].x; });
+
+	while (!stack.empty()) {
+		Item item = stack.back();
+		stack.pop_back();
+
+		if (levels.size() < item.level + 2)
+			levels.resize(item.level + 2);
+
+		const BoxTree::Entry& e = entries[item.entry];
+		const std::vector<size_t>& in = levels[item.level];
+		std::vector<size_t>& out = levels[item.level + 1];
+		out.clear();
+
+		for (size_t k : in) {
+			const Pair& p = points[k];
+
+			if (p.x >= e.box[0].x && p.x <= e.box[1].x && p.y >= e.box[0].y && p.y <= e.box[1].y)
+				out.push_back(k);
+		}
+
+		if (out.empty())
+			continue;
+
+		if (e.count == 0) {
+			const std::vector<Pair>& v = m_polys[e.index].m_pairs;
+
+			gathered.resize(out.size());
+			inside.resize(out.size());
+
+			for (size_t k = 0; k < out.size(); k++)
+				gathered[k] = points[out[k]];
+
+			InsidePairs(v.data(), v.size(), gathered.data(), gathered.size(), inside.data());
+
+			for (size_t k = 0; k < out.size(); k++)
+				if (inside[k])
+					hits.push_back(std::make_pair(out[k], size_t(e.index)));
+
+			continue;
+		}
+
+		// The children share out, which stays untouched until the last one is
+		// taken: they are pushed together and only deeper levels are written.
+		for (uint32_t c = e.index + e.count; c-- > e.index;)
+			stack.push_back({ c, item.level + 1 });
+	}
+}
+
+bool PolyIndex::Nearest(uint16_t layer, Pair p, size_t& hit, double& distance) const
+{
+	// Best first search: entries are visited by increasing distance from p;
+	// a polygon is queued first by its box distance and again by its exact
+	// distance, so the first exact one taken is the nearest.
+
+	auto tree = m_trees.find(layer);
+
+	if (tree == m_trees.end())
+		return false;
+
+	const std::vector<BoxTree::Entry>& entries = tree->second.entries;
+
+	// (squared distance, entry, exact)
+	typedef std::tuple<double, uint32_t, bool> Item;
+	std::priority_queue<Item, std::vector<Item>, std::greater<Item>> queue;
+
+	uint32_t root = uint32_t(entries.size() - 1);
+	queue.push(Item(BoxDistance2(entries[root].box, p), root, false));
+
+	while (!queue.empty()) {
+		Item item = queue.top();
+		queue.pop();
+
+		const BoxTree::Entry& e = entries[std::get<1>(item)];
+
+		if (e.count == 0) {
+			if (std::get<2>(item)) {
+				hit = e.index;
+				distance = sqrt(std::get<0>(item));
+				return true;
+			}
+
+			queue.push(Item(PolyDistance2(m_polys[e.index], p), std::get<1>(item), true));
+			continue;
+		}
+
+		for (uint32_t c = e.index; c < e.index + e.count; c++)
+			queue.push(Item(BoxDistance2(entries[c].box, p), c, false));
+	}
+
+	return false;
+}
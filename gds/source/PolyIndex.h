@@ -0,0 +1,90 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#pragma once
+
+#include "Polygon.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace GDS {
+
+	// Packed R-tree over boxes with an id each, bulk loaded with
+	// Sort-Tile-Recursive: Add all boxes, then Pack once before querying.
+	struct BoxTree {
+		void Add(const Pair* box, uint32_t id);
+		void Pack();
+
+		// Append the ids of the boxes overlapping box (min, max corners) to hits
+		void Window(const Pair* box, std::vector<size_t>& hits) const;
+
+		// Append the ids of the boxes passing test to hits, looking only into
+		// the nodes passing it; test(box) must hold for a node if it holds
+		// for any box under it
+		template <class Test>
+		void Search(Test test, std::vector<size_t>& hits) const
+		{
+			if (entries.empty())
+				return;
+
+			std::vector<uint32_t> stack = { uint32_t(entries.size() - 1) };
+
+			while (!stack.empty()) {
+				const Entry& e = entries[stack.back()];
+				stack.pop_back();
+
+				if (!test(e.box))
+					continue;
+
+				if (e.count == 0)
+					hits.push_back(e.index);
+				else
+					for (uint32_t c = e.index + e.count; c-- > e.index;)
+						stack.push_back(c);
+			}
+		}
+
+		struct Entry {
+			Pair box[2];
+			uint32_t index; // Id of the box, or index of the first child node
+			uint32_t count; // Number of child nodes; 0 for a box
+		};
+
+		// Entries of all levels, the boxes first and the root last
+		std::vector<Entry> entries;
+	};
+
+	// Spatial index over a vector of polygons, like the one filled by
+	// Database::CollapseCell: a BoxTree per layer. Queries return indices in the vector, which must
+	// not change while the index is in use.
+	struct PolyIndex {
+		explicit PolyIndex(const std::vector<Polygon>& polys);
+
+		// Append the polygons on layer whose bounding box overlaps box (min,
+		// max corners) to hits
+		void Window(uint16_t layer, const Pair* box, std::vector<size_t>& hits) const;
+
+		// Append the polygons on layer containing p to hits
+		void Point(uint16_t layer, Pair p, std::vector<size_t>& hits) const;
+
+		// Append (point, polygon) to hits for every polygon on layer containing
+		// one of the points. The points are taken down the tree together, so
+		// each node is visited once for all points in its box.
+		void Points(uint16_t layer, const Pair* points, size_t count, std::vector<std::pair<size_t, size_t>>& hits) const;
+
+		// The polygon on layer closest to p by the distance from p to its
+		// outline, 0 if p is inside. Return false if the layer is empty.
+		bool Nearest(uint16_t layer, Pair p, size_t& hit, double& distance) const;
+
+		const std::vector<Polygon>& m_polys;
+		std::unordered_map<uint16_t, BoxTree> m_trees;
+	};
+}
@@ -0,0 +1,233 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "Raster.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+using namespace GDS;
+
+static void WriteImage(const wchar_t* file, const std::string& header, const RasterImage& image)
+{
+	FILE* out = nullptr;
+
+	_wfopen_s(&out, file, L"wb");
+	if (!out)
+		throw std::runtime_error("Failure creating file for writing");
+
+	bool ok = fwrite(header.data(), 1, header.size(), out) == header.size() &&
+		fwrite(image.pixels.data(), 1, image.pixels.size(), out) == image.pixels.size();
+
+	if (fclose(out) != 0 || !ok)
+		throw std::runtime_error("Failure writing to file");
+}
+
+void RasterImage::WritePgm(const wchar_t* file) const
+{
+	WriteImage(file, "P5\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n", *this);
+}
+
+void RasterImage::WriteRaw(const wchar_t* file) const
+{
+	WriteImage(file, std::string(), *this);
+}
+
+Rasterizer::Rasterizer(unsigned width, unsigned height, double x0, double y0, double sx, double sy)
+	: m_width(width), m_height(height), m_x0(x0), m_y0(y0), m_sx(sx), m_sy(sy),
+	m_area(size_t(width + 2) * height, 0.0f)
+{
+}
+
+void Rasterizer::AddPoly(const Pair* p, size_t size)
+{
+	// The closing point is not needed
+	size_t n = size;
+
+	if (n > 1 && p[0].x == p[n - 1].x && p[0].y == p[n - 1].y)
+		n--;
+
+	if (n < 3)
+		return;
+
+	double area = 0.0;
+
+	for (size_t i = 0; i < n; i++) {
+		const Pair& a = p[i];
+		const Pair& b = p[(i + 1) % n];
+
+		area += double(a.x) * b.y - double(b.x) * a.y;
+	}
+
+	if (area == 0.0)
+		return;
+
+	// Inside a counter clockwise polygon is left of its edges; the sums come
+	// out positive inside whatever the orientation
+	double dir = area > 0.0 ? -1.0 : 1.0;
+	double fx = 1.0 / m_sx, fy = 1.0 / m_sy;
+
+	for (size_t i = 0; i < n; i++) {
+		const Pair& a = p[i];
+		const Pair& b = p[(i + 1) % n];
+
+		// Horizontal edges add nothing
+		if (a.y != b.y)
+			AddEdge((a.x - m_x0) * fx, (a.y - m_y0) * fy, (b.x - m_x0) * fx, (b.y - m_y0) * fy, dir);
+	}
+}
+
+void Rasterizer::AddEdge(double x0, double y0, double x1, double y1, double dir)
+{
+	// Split an edge in pixel coordinates where it crosses the left and right
+	// side. The parts outside count as if on the side: left of the block
+	// they cover whole rows, right of it nothing.
+
+	double w = m_width;
+
+	if (y0 == y1 || (y0 < 0.0 && y1 < 0.0) || (y0 >= m_height && y1 >= m_height))
+		return;
+
+	if (x0 >= 0.0 && x0 <= w && x1 >= 0.0 && x1 <= w) {
+		AddLine(x0, y0, x1, y1, dir);
+		return;
+	}
+
+	double cuts[2] = { 0.0, w };
+	double ys[4] = { y0, y0, y0, y1 };
+	size_t count = 1;
+
+	for (double cut : cuts) {
+		if ((x0 < cut) != (x1 < cut))
+			ys[count++] = y0 + (cut - x0) * (y1 - y0) / (x1 - x0);
+	}
+
+	ys[count] = y1;
+
+	if (count == 3 && (ys[1] > y0) != (ys[2] > ys[1]))
+		std::swap(ys[1], ys[2]);
+
+	for (size_t i = 0; i < count; i++) {
+		double ya = ys[i], yb = ys[i + 1];
+
+		if (ya == yb)
+			continue;
+
+		double xa = std::min(w, std::max(0.0, x0 + (ya - y0) * (x1 - x0) / (y1 - y0)));
+		double xb = std::min(w, std::max(0.0, x0 + (yb - y0) * (x1 - x0) / (y1 - y0)));
+
+		// Parts right of the block do not cover any pixel of it
+		if (xa == w && xb == w)
+			continue;
+
+		AddLine(xa, ya, xb, yb, dir);
+	}
+}
+
+void Rasterizer::AddLine(double x0, double y0, double x1, double y1, double dir)
+{
+	// Add the signed area of a line with 0 <= x <= width to the pixels of
+	// every row it crosses: the part of the pixel right of the line times
+	// its height in the row, with the rest going to the pixel after it.
+
+	if (y1 < y0) {
+		std::swap(x0, x1);
+		std::swap(y0, y1);
+		dir = -dir;
+	}
+
+	if (y1 <= 0.0 || y0 >= m_height)
+		return;
+
+	double dxdy = (x1 - x0) / (y1 - y0);
+	double w = m_width;
+
+	// x at the bottom and top of the line in each row, kept in the block
+	// against rounding
+	auto at = [&](double y) {
+		return std::min(w, std::max(0.0, x0 + (y - y0) * dxdy));
+	};
+
+	double x = y0 < 0.0 ? at(0.0) : x0;
+
+	unsigned first = y0 < 0.0 ? 0 : unsigned(y0);
+	unsigned last = unsigned(std::min(double(m_height), std::ceil(y1)));
+
+	for (unsigned y = first; y < last; y++) {
+		float* row = &m_area[size_t(y) * (m_width + 2)];
+		double ytop = std::min(y + 1.0, y1);
+		double dy = ytop - std::max(double(y), y0);
+		double xnext = ytop == y1 ? x1 : at(ytop);
+		double d = dy * dir;
+		double xa = std::min(x, xnext), xb = std::max(x, xnext);
+		double xafloor = std::floor(xa), xbceil = std::ceil(xb);
+		int xai = int(xafloor), xbi = int(xbceil);
+
+		if (xbi <= xai + 1) {
+			// Within one pixel: split at the middle of the line
+			double xm = 0.5 * (x + xnext) - xafloor;
+
+			row[xai] += float(d - d * xm);
+			row[xai + 1] += float(d * xm);
+		}
+		else {
+			// Over several pixels: the triangles at its ends and the even
+			// parts in between
+			double s = 1.0 / (xb - xa);
+			double xaf = xa - xafloor;
+			double a0 = 0.5 * s * (1.0 - xaf) * (1.0 - xaf);
+			double xbf = xb - xbceil + 1.0;
+			double am = 0.5 * s * xbf * xbf;
+
+			row[xai] += float(d * a0);
+
+			if (xbi == xai + 2) {
+				row[xai + 1] += float(d * (1.0 - a0 - am));
+			}
+			else {
+				double a1 = s * (1.5 - xaf);
+
+				row[xai + 1] += float(d * (a1 - a0));
+
+				for (int xi = xai + 2; xi < xbi - 1; xi++)
+					row[xi] += float(d * s);
+
+				double a2 = a1 + (xbi - xai - 3) * s;
+
+				row[xbi - 1] += float(d * (1.0 - a2 - am));
+			}
+
+			row[xbi] += float(d * am);
+		}
+
+		x = xnext;
+	}
+}
+
+void Rasterizer::Resolve(RasterImage& image, unsigned col, unsigned row, bool antialias) const
+{
+	for (unsigned y = 0; y < m_height; y++) {
+		const float* area = &m_area[size_t(y) * (m_width + 2)];
+		uint8_t* out = &image.pixels[size_t(image.height - 1 - (row + y)) * image.width + col];
+		float sum = 0.0f;
+
+		for (unsigned x = 0; x < m_width; x++) {
+			sum += area[x];
+
+			float cover = std::min(1.0f, std::max(0.0f, sum));
+
+			if (antialias)
+				out[x] = uint8_t(cover * 255.0f + 0.5f);
+			else
+				out[x] = cover >= 0.5f ? 255 : 0;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#pragma once
+
+#include "Polygon.h"
+
+#include <vector>
+
+namespace GDS {
+
+	// A gray scale image, row by row from the top; 0 is empty and 255 is
+	// fully covered
+	struct RasterImage {
+		unsigned width = 0, height = 0;
+		std::vector<uint8_t> pixels;
+
+		void WritePgm(const wchar_t* file) const; // Binary PGM (P5)
+		void WriteRaw(const wchar_t* file) const; // Only the pixels
+	};
+
+	// Accumulates the area of polygons in a block of pixels. Every edge adds
+	// its signed area to the pixels it crosses, so that the sum along a row
+	// up to a pixel is the part of it covered. Overlapping polygons add up,
+	// so only non-overlapping ones (see Merge) give the exact coverage; the
+	// sum is clamped to one.
+	struct Rasterizer {
+		// A block of width x height pixels of sx x sy database units, with
+		// its lower left corner at (x0, y0)
+		Rasterizer(unsigned width, unsigned height, double x0, double y0, double sx, double sy);
+
+		// Add a closed polygon in database units, of either orientation
+		void AddPoly(const Pair* p, size_t size);
+
+		// Write the coverage of the pixels to image, with the lower left one
+		// at column col and row row counted from the bottom. Without
+		// antialias a pixel is 255 if at least half of it is covered and 0
+		// if not.
+		void Resolve(RasterImage& image, unsigned col, unsigned row, bool antialias) const;
+
+		unsigned m_width, m_height;
+		double m_x0, m_y0, m_sx, m_sy;
+
+		// width + 2 per row, from the bottom row up; the last two are for
+		// edges on or right of the right side
+		std::vector<float> m_area;
+
+	private:
+		void AddEdge(double x0, double y0, double x1, double y1, double dir);
+		void AddLine(double x0, double y0, double x1, double y1, double dir);
+	};
+}
@@ -1,13 +1,14 @@
 #include "StringConverter.h"
 
-std::wstring to_wstring(std::string str)
+std::wstring to_wstring(const std::string& str)
 {
-    std::wstring out;
+    // Widen each byte; names in a GDS file are ASCII
 
-    for (char& c : str)
+    std::wstring out(str.size(), L'\0');
+
+    for (size_t i = 0; i < str.size(); i++)
     {
-        wchar_t cw = wchar_t(0x0000 + c);
-        out = out + cw;
+        out[i] = wchar_t((unsigned char)str[i]);
     }
 
     return out;
@@ -1,5 +1,5 @@
 #include <string>
 
-std::wstring to_wstring(std::string str);
+std::wstring to_wstring(const std::string& str);
 
 
@@ -0,0 +1,108 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace GDS {
+	struct TaskQueue {
+		std::mutex lock;
+		std::deque<size_t> tasks;
+	};
+}
+
+using namespace GDS;
+
+static bool PopTask(std::vector<TaskQueue>& queues, size_t self, size_t& task)
+{
+	// Take the next task of the own queue, or else steal the last task of
+	// another queue. No tasks are added once started, so when all queues are
+	// empty the work is done.
+
+	{
+		std::lock_guard<std::mutex> guard(queues[self].lock);
+		if (!queues[self].tasks.empty()) {
+			task = queues[self].tasks.front();
+			queues[self].tasks.pop_front();
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < queues.size(); i++) {
+		TaskQueue& victim = queues[(self + i) % queues.size()];
+
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+unsigned GDS::HardwareThreads()
+{
+	return std::max(1U, std::thread::hardware_concurrency());
+}
+
+void GDS::RunTasks(size_t count, unsigned threads, const std::function<void(size_t)>& task)
+{
+	if (threads == 0)
+		threads = HardwareThreads();
+	if (threads > count)
+		threads = unsigned(count);
+
+	if (threads < 2) {
+		for (size_t i = 0; i < count; i++)
+			task(i);
+		return;
+	}
+
+	std::vector<TaskQueue> queues(threads);
+	std::vector<std::exception_ptr> errors(threads);
+	std::atomic<bool> failed(false);
+
+	for (size_t t = 0; t < threads; t++) {
+		for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++)
+			queues[t].tasks.push_back(i);
+	}
+
+	auto worker = [&](size_t t) {
+		try {
+			size_t i;
+
+			while (!failed && PopTask(queues, t, i))
+				task(i);
+		}
+		catch (...) {
+			errors[t] = std::current_exception();
+			failed = true;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (size_t t = 1; t < threads; t++)
+		pool.emplace_back(worker, t);
+	worker(0);
+	for (auto& it : pool)
+		it.join();
+
+	for (auto& it : errors) {
+		if (it)
+			std::rethrow_exception(it);
+	}
+}
@@ -0,0 +1,22 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#pragma once
+
+#include <functional>
+
+namespace GDS {
+
+	// Run task(0) .. task(count - 1) on up to 'threads' threads (0 for one per
+	// hardware thread). Every thread starts on its own contiguous block of the
+	// tasks and steals from the end of the blocks of the others when done.
+	// The first exception thrown by a task stops the pool and is rethrown.
+	void RunTasks(size_t count, unsigned threads, const std::function<void(size_t)>& task);
+
+	unsigned HardwareThreads();
+}
@@ -0,0 +1,249 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#include "Writer.h"
+#include "GdsRecords.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace GDS;
+
+static void BufWriteShort(uint8_t* p, uint16_t n)
+{
+	p[0] = uint8_t((n >> 8) & 0xFF);
+	p[1] = uint8_t(n & 0xFF);
+}
+
+static void BufWriteInt(uint8_t* p, int32_t n)
+{
+	p[0] = uint8_t((n >> 24) & 0xFF);
+	p[1] = uint8_t((n >> 16) & 0xFF);
+	p[2] = uint8_t((n >> 8) & 0xFF);
+	p[3] = uint8_t(n & 0xFF);
+}
+
+static void BufWriteHeader(uint8_t* p, uint16_t record, size_t len)
+{
+	// Record header for len bytes of data
+	BufWriteShort(p, uint16_t(len + 4));
+	BufWriteShort(p + 2, record);
+}
+
+Writer::Writer(const wchar_t* file, bool async, size_t buffer_size) : m_async(async)
+{
+	_wfopen_s(&m_file, file, L"wb");
+	if (!m_file)
+		throw std::runtime_error("Failure creating file for writing");
+
+	// Room for at least the largest possible record
+	if (buffer_size < 0x10000)
+		buffer_size = 0x10000;
+
+	m_buffer.resize(buffer_size);
+	if (m_async)
+		m_spare.resize(buffer_size);
+}
+
+Writer::~Writer()
+{
+	try
+	{
+		Close();
+	}
+	catch (...)
+	{
+	}
+}
+
+void Writer::Close()
+{
+	if (!m_file)
+		return;
+
+	try
+	{
+		Flush();
+		Wait();
+	}
+	catch (...)
+	{
+		fclose(m_file);
+		m_file = nullptr;
+		throw;
+	}
+
+	fclose(m_file);
+	m_file = nullptr;
+}
+
+uint8_t* Writer::Reserve(size_t len)
+{
+	// Space for len bytes in the output buffer
+
+	if (m_pos + len > m_buffer.size()) {
+		Flush();
+
+		// Elements can be larger than the buffer, like very long polygons
+		if (len > m_buffer.size())
+			m_buffer.resize(len);
+	}
+
+	uint8_t* p = m_buffer.data() + m_pos;
+	m_pos += len;
+	m_written += len;
+
+	return p;
+}
+
+void Writer::Flush()
+{
+	if (m_pos == 0)
+		return;
+
+	if (!m_async) {
+		if (fwrite(m_buffer.data(), 1, m_pos, m_file) != m_pos)
+			throw std::runtime_error("Failure writing to file");
+		m_pos = 0;
+		return;
+	}
+
+	// Write the full buffer in the background and continue in the spare one
+	Wait();
+	std::swap(m_buffer, m_spare);
+
+	size_t len = m_pos;
+	m_pos = 0;
+
+	m_flusher = std::thread([this, len]() {
+		if (fwrite(m_spare.data(), 1, len, m_file) != len)
+			m_failed = true;
+	});
+}
+
+void Writer::Wait()
+{
+	if (m_flusher.joinable())
+		m_flusher.join();
+
+	if (m_failed)
+		throw std::runtime_error("Failure writing to file");
+}
+
+void Writer::AppendRecord(uint16_t record)
+{
+	BufWriteHeader(Reserve(4), record, 0);
+}
+
+void Writer::AppendShort(uint16_t record, uint16_t data)
+{
+	uint8_t* p = Reserve(6);
+
+	BufWriteHeader(p, record, 2);
+	BufWriteShort(p + 4, data);
+}
+
+void Writer::AppendBytes(uint16_t record, const uint8_t* data, size_t len)
+{
+	if (len > 0xFFFF - 4)
+		throw std::runtime_error("GDS record too large");
+
+	uint8_t* p = Reserve(4 + len);
+
+	BufWriteHeader(p, record, len);
+	memcpy(p + 4, data, len);
+}
+
+void Writer::AppendString(uint16_t record, const char* string)
+{
+	size_t text_len, record_len;
+
+	text_len = strlen(string);
+
+	// Strings are padded to an even length
+	record_len = text_len;
+	if (text_len % 2) record_len++;
+
+	if (record_len > 0xFFFF - 4)
+		throw std::runtime_error("GDS record too large");
+
+	uint8_t* p = Reserve(4 + record_len);
+
+	BufWriteHeader(p, record, record_len);
+	memcpy(p + 4, string, text_len);
+	if (text_len % 2) p[4 + text_len] = 0;
+}
+
+void Writer::AppendPoly(const Pair* pairs, size_t size, uint16_t layer, uint16_t datatype)
+{
+	// Store polygon in buffer in the format of the gds standard. Polygons
+	// with more pairs than fit in one record continue in further XY records,
+	// which is how other tools write long polygons as well.
+
+	const size_t max_pairs = 8190;
+	size_t records = size ? (size + max_pairs - 1) / max_pairs : 1;
+
+	uint8_t* p = Reserve(4 + 6 + 6 + 4 * records + 8 * size + 4);
+
+	BufWriteHeader(p, GDS_BOUNDARY, 0);
+	p += 4;
+
+	BufWriteHeader(p, GDS_LAYER, 2);
+	BufWriteShort(p + 4, layer);
+	p += 6;
+
+	BufWriteHeader(p, GDS_DATATYPE, 2);
+	BufWriteShort(p + 4, datatype);
+	p += 6;
+
+	for (size_t r = 0; r < records; r++) {
+		size_t count = std::min(max_pairs, size - r * max_pairs);
+		const Pair* chunk = pairs + r * max_pairs;
+
+		BufWriteHeader(p, GDS_XY, 8 * count);
+		p += 4;
+		for (size_t i = 0; i < count; i++) {
+			BufWriteInt(p + 8 * i, chunk[i].x);
+			BufWriteInt(p + 8 * i + 4, chunk[i].y);
+		}
+		p += 8 * count;
+	}
+
+	BufWriteHeader(p, GDS_ENDEL, 0);
+}
+
+void Writer::BeginLibrary(const uint8_t* units)
+{
+	// 24 bytes needed for GDS_BGNLIB.
+	uint8_t access[24] = { 0 };
+
+	AppendShort(GDS_HEADER, 600);
+	AppendBytes(GDS_BGNLIB, access, 24);
+	AppendString(GDS_LIBNAME, "");
+	AppendBytes(GDS_UNITS, units, 16);
+}
+
+void Writer::BeginStructure(const char* name)
+{
+	// 24 bytes needed for GDS_BGNSTR.
+	uint8_t access[24] = { 0 };
+
+	AppendBytes(GDS_BGNSTR, access, 24);
+	AppendString(GDS_STRNAME, name);
+}
+
+void Writer::EndStructure()
+{
+	AppendRecord(GDS_ENDSTR);
+}
+
+void Writer::EndLibrary()
+{
+	AppendRecord(GDS_ENDLIB);
+}
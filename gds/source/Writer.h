@@ -0,0 +1,66 @@
+/*
+* Copyright(c) 2022, Jan Willem Bos - janwillembos@yahoo.com
+* All rights reserved.
+*
+* This source code is licensed under the BSD - style license found in the
+* LICENSE file in the root directory of this source tree.
+*/
+
+#pragma once
+
+#include "Polygon.h"
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace GDS {
+
+	// Writes GDS records to a file through a large output buffer that is
+	// flushed in big sequential writes. In async mode the buffer is written
+	// by a background thread while the records that follow are collected in
+	// a second buffer.
+	struct Writer {
+		Writer(const wchar_t* file, bool async = false, size_t buffer_size = 0x100000);
+		~Writer();
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		// Flush and close the file; reports write errors by throwing.
+		void Close();
+
+		void AppendRecord(uint16_t record);
+		void AppendShort(uint16_t record, uint16_t data);
+		void AppendBytes(uint16_t record, const uint8_t* data, size_t len);
+		void AppendString(uint16_t record, const char* string);
+
+		// BOUNDARY, LAYER, DATATYPE, XY and ENDEL records of a polygon
+		void AppendPoly(const Pair* p, size_t size, uint16_t layer, uint16_t datatype = 0);
+
+		// HEADER, BGNLIB, LIBNAME and UNITS records (raw GDS_UNITS data)
+		void BeginLibrary(const uint8_t* units);
+
+		// BGNSTR and STRNAME records
+		void BeginStructure(const char* name);
+
+		void EndStructure();
+		void EndLibrary();
+
+		uint64_t m_written = 0; // Number of bytes written to the file
+
+	private:
+		uint8_t* Reserve(size_t len);
+		void Flush();
+		void Wait();
+
+		FILE* m_file = nullptr;
+
+		std::vector<uint8_t> m_buffer, m_spare;
+		size_t m_pos = 0;
+
+		bool m_async;
+		std::thread m_flusher;
+		bool m_failed = false;
+	};
+}